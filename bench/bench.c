@@ -0,0 +1,320 @@
+// load_elf benchmarks on generated images, report printed as one json object
+// usage: bench_main [exports imports relocs]
+//        bench_main --gen path exports imports relocs [text_pages]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "load_elf.h"
+#include "logger.h"
+#include "reloc.h"
+#include "gen_elf.h"
+
+#if defined(X64)
+	#define ARCH "x64"
+#elif defined(X86)
+	#define ARCH "x86"
+#elif defined(ARM64) || defined(AARCH64)
+	#define ARCH "arm64"
+#elif defined(ARM)
+	#define ARCH "arm"
+#endif
+
+#define RUNS 15
+#define TEXT_PAGES 1024 // 4MB, enough for a few huge pages
+#define BATCH 8
+
+typedef unsigned long long ullong;
+
+static char dir[] = "/tmp/load_elf_bench.XXXXXX";
+
+// the classes gen_elf generates, reported per class (tls is not supported by load_elf)
+static const struct { const char* name; int cls; } reloc_classes[] = {
+	{ "relative", RELOC_RELATIVE },
+	{ "absolute", RELOC_ABSOLUTE },
+	{ "glob_dat", RELOC_GLOB_DAT },
+	{ "jump_slot", RELOC_JUMP_SLOT },
+	{ "pc_relative", RELOC_PC_RELATIVE },
+	{ "copy", RELOC_COPY },
+	{ "irelative", RELOC_IRELATIVE },
+};
+
+static ullong now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ullong) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_ullong(const void* a, const void* b) {
+	ullong x = *(const ullong*) a;
+	ullong y = *(const ullong*) b;
+	return x < y ? -1 : x > y;
+}
+
+static ullong median(ullong* samples, int count) {
+	qsort(samples, count, sizeof(ullong), compare_ullong);
+	return samples[count / 2];
+}
+
+static int filter() {
+	return 1;
+}
+
+static const char* bench_path(const char* name) {
+	static char path[4][512];
+	static int next = 0;
+	char* p = path[next++ % 4];
+	snprintf(p, sizeof(path[0]), "%s/%s", dir, name);
+	return p;
+}
+
+static void generate(const char* name, const char* export_prefix, size_t exports, size_t imports, size_t relocs, size_t text_pages) {
+	gen_elf_options options = { name, export_prefix, exports, "bench_import_", imports, relocs, text_pages };
+	if (!gen_elf(bench_path(name), &options)) {
+		fprintf(stderr, "failed to write %s\n", bench_path(name));
+		exit(1);
+	}
+}
+
+static char** make_names(const char* prefix, size_t count) {
+	char** names = (char**) malloc(count * sizeof(char*) + 1);
+	char buf[64];
+	for (size_t i = 0; i < count; i++) {
+		snprintf(buf, sizeof(buf), "%s%lu", prefix, (unsigned long) i);
+		names[i] = strdup(buf);
+	}
+	return names;
+}
+
+// iTLB read misses of this thread in user space, -1 if perf events are not available
+static int open_itlb_counter() {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// load_elf against dlopen on the same image, median of RUNS
+static void bench_load(const char* path) {
+	ullong samples[RUNS];
+	for (int i = 0; i < RUNS; i++) {
+		invalidate_symbol_cache();
+		ullong start = now();
+		void* base = load_elf(path);
+		samples[i] = now() - start;
+		unload_elf(base);
+	}
+	ullong load_elf_ns = median(samples, RUNS);
+	const load_stats* stats = get_load_stats();
+	size_t relocs = 0;
+	for (int i = 0; i < LOAD_STATS_RELOC_CLASSES; i++) relocs += stats->relocs[i];
+	for (int i = 0; i < RUNS; i++) {
+		ullong start = now();
+		void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+		samples[i] = now() - start;
+		if (handle == NULL) {
+			fprintf(stderr, "dlopen: %s\n", dlerror());
+			exit(1);
+		}
+		dlclose(handle);
+	}
+	printf("\"load\": {\"load_elf_ns\": %llu, \"dlopen_ns\": %llu, \"relocs\": %lu, \"reloc_ns\": %llu, \"relocs_per_sec\": %.0f, \"reloc_classes\": {",
+		load_elf_ns, median(samples, RUNS), (unsigned long) relocs, stats->reloc_ns, stats->reloc_ns ? relocs * 1e9 / stats->reloc_ns : 0.0);
+	for (size_t i = 0; i < sizeof(reloc_classes) / sizeof(reloc_classes[0]); i++) {
+		printf("%s\"%s\": %lu", i ? ", " : "", reloc_classes[i].name, (unsigned long) stats->relocs[reloc_classes[i].cls]);
+	}
+	printf("}}");
+}
+
+// ns per lookup, names looked up in order until at least 1M lookups
+static double time_lookups(void* (*lookup)(void*, const char*), void* handle, char** names, size_t count, int invalidate) {
+	size_t rounds = 1000000 / (count ? count : 1) + 1;
+	ullong total = 0;
+	for (size_t r = 0; r < rounds; r++) {
+		if (invalidate) invalidate_symbol_cache();
+		ullong start = now();
+		for (size_t i = 0; i < count; i++) lookup(handle, names[i]);
+		total += now() - start;
+	}
+	return (double) total / (rounds * (count ? count : 1));
+}
+
+static void* by_name(void* base, const char* name) {
+	return get_symbol_by_name(base, name);
+}
+
+static void* by_image(void* image, const char* name) {
+	return get_image_symbol((const loaded_image*) image, name);
+}
+
+static void* global(void* unused, const char* name) {
+	return get_global_symbol(name);
+}
+
+static void* by_dlsym(void* handle, const char* name) {
+	return dlsym(handle, name);
+}
+
+static void bench_lookup(const char* path, size_t exports, size_t imports) {
+	void* base = load_elf(path);
+	void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	char** export_names = make_names("bench_export_", exports);
+	char** missing_names = make_names("bench_missing_", exports);
+	char** import_names = make_names("bench_import_", imports);
+	printf("\"lookup\": {\"get_symbol_by_name_ns\": %.1f, \"get_symbol_by_name_miss_ns\": %.1f, \"get_image_symbol_ns\": %.1f, \"dlsym_ns\": %.1f, "
+		"\"get_global_symbol_cold_ns\": %.1f, \"get_global_symbol_warm_ns\": %.1f}",
+		time_lookups(by_name, base, export_names, exports, 0),
+		time_lookups(by_name, base, missing_names, exports, 0),
+		time_lookups(by_image, (void*) get_loaded_image(base), export_names, exports, 0),
+		time_lookups(by_dlsym, handle, export_names, exports, 0),
+		time_lookups(global, NULL, import_names, imports, 1),
+		time_lookups(global, NULL, import_names, imports, 0));
+	dlclose(handle);
+	unload_elf(base);
+}
+
+// set_reloc_threads scaling on one big image
+static void bench_reloc_threads(const char* path) {
+	printf("\"reloc_threads\": [");
+	for (int threads = 1; threads <= 16; threads *= 2) {
+		set_reloc_threads(threads);
+		ullong samples[RUNS / 3];
+		for (int i = 0; i < RUNS / 3; i++) {
+			invalidate_symbol_cache();
+			void* base = load_elf(path);
+			samples[i] = get_load_stats()->reloc_ns;
+			unload_elf(base);
+		}
+		printf("%s{\"threads\": %d, \"reloc_ns\": %llu}", threads > 1 ? ", " : "", threads, median(samples, RUNS / 3));
+	}
+	set_reloc_threads(1);
+	printf("]");
+}
+
+// load_elfs scaling on BATCH independent images
+static void bench_load_elfs() {
+	const char* paths[BATCH];
+	char names[BATCH][32];
+	for (int i = 0; i < BATCH; i++) {
+		snprintf(names[i], sizeof(names[i]), "libbench_batch%d.so", i);
+		generate(names[i], "bench_export_", 2000, 200, 20000, 0);
+		paths[i] = strdup(bench_path(names[i]));
+	}
+	printf("\"load_elfs\": [");
+	for (int threads = 1; threads <= BATCH; threads *= 2) {
+		ullong samples[RUNS / 3];
+		for (int i = 0; i < RUNS / 3; i++) {
+			void* bases[BATCH];
+			invalidate_symbol_cache();
+			ullong start = now();
+			load_elfs(paths, bases, BATCH, threads);
+			samples[i] = now() - start;
+			for (int j = 0; j < BATCH; j++) unload_elf(bases[j]);
+		}
+		printf("%s{\"threads\": %d, \"ns\": %llu}", threads > 1 ? ", " : "", threads, median(samples, RUNS / 3));
+	}
+	printf("]");
+	for (int i = 0; i < BATCH; i++) {
+		unlink(paths[i]);
+		free((void*) paths[i]);
+	}
+}
+
+// first call into each text page after loading, then iTLB misses of calling them again
+static void bench_text(const char* path) {
+	static const struct { const char* name; int options; } modes[] = {
+		{ "default", 0 },
+		{ "populate", LOAD_POPULATE },
+		{ "hugepage", LOAD_HUGEPAGE },
+	};
+	char** names = make_names("bench_export_text_", TEXT_PAGES);
+	printf("\"text\": [");
+	for (int m = 0; m < 3; m++) {
+		set_load_options(modes[m].options);
+		ullong start = now();
+		void* base = load_elf(path);
+		ullong load_ns = now() - start;
+		void (*funcs[TEXT_PAGES])();
+		for (int i = 0; i < TEXT_PAGES; i++) funcs[i] = (void (*)()) get_symbol_by_name(base, names[i]);
+		start = now();
+		for (int i = 0; i < TEXT_PAGES; i++) funcs[i]();
+		ullong first_call_ns = now() - start;
+		long long misses = -1;
+		int fd = open_itlb_counter();
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			for (int r = 0; r < 16; r++) {
+				for (int i = 0; i < TEXT_PAGES; i++) funcs[i]();
+			}
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+			close(fd);
+		}
+		unload_elf(base);
+		printf("%s{\"mode\": \"%s\", \"load_ns\": %llu, \"first_call_ns\": %llu, \"itlb_misses\": ", m ? ", " : "", modes[m].name, load_ns, first_call_ns);
+		if (misses < 0) printf("null}");
+		else printf("%lld}", misses);
+	}
+	set_load_options(0);
+	printf("]");
+}
+
+int main(int argc, char** argv) {
+	if (argc >= 6 && strcmp(argv[1], "--gen") == 0) {
+		const char* slash = strrchr(argv[2], '/');
+		gen_elf_options options = { slash ? slash + 1 : argv[2], "bench_export_", strtoul(argv[3], NULL, 0),
+			"bench_import_", strtoul(argv[4], NULL, 0), strtoul(argv[5], NULL, 0), argc > 6 ? strtoul(argv[6], NULL, 0) : 0 };
+		return gen_elf(argv[2], &options) ? 0 : 1;
+	}
+	size_t exports = argc > 3 ? strtoul(argv[1], NULL, 0) : 2000;
+	size_t imports = argc > 3 ? strtoul(argv[2], NULL, 0) : 200;
+	size_t relocs = argc > 3 ? strtoul(argv[3], NULL, 0) : 20000;
+
+	SET_LOGE();
+	init_array_filter = (void*) filter;
+	set_load_base(NULL);
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	// imports of the other images, visible to both dlopen and load_elf
+	generate("libbench_import.so", "bench_import_", imports > 200 ? imports : 200, 0, 0, 0);
+	if (dlopen(bench_path("libbench_import.so"), RTLD_NOW | RTLD_GLOBAL) == NULL) {
+		fprintf(stderr, "dlopen: %s\n", dlerror());
+		return 1;
+	}
+	generate("libbench.so", "bench_export_", exports, imports, relocs, 0);
+	generate("libbench_big.so", "bench_export_", 2000, 200, 200000, 0);
+	generate("libbench_text.so", "bench_export_", 16, 0, 0, TEXT_PAGES);
+
+	printf("{\"arch\": \"" ARCH "\", \"cpus\": %ld, \"exports\": %lu, \"imports\": %lu, \"relocs\": %lu, ",
+		sysconf(_SC_NPROCESSORS_ONLN), (unsigned long) exports, (unsigned long) imports, (unsigned long) relocs);
+	bench_load(bench_path("libbench.so"));
+	printf(", ");
+	bench_lookup(bench_path("libbench.so"), exports, imports);
+	printf(", ");
+	bench_reloc_threads(bench_path("libbench_big.so"));
+	printf(", ");
+	bench_load_elfs();
+	printf(", ");
+	bench_text(bench_path("libbench_text.so"));
+	printf("}\n");
+
+	unlink(bench_path("libbench.so"));
+	unlink(bench_path("libbench_big.so"));
+	unlink(bench_path("libbench_text.so"));
+	unlink(bench_path("libbench_import.so"));
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "elf_struct.h"
+#include "symbol_table.h"
+#include "gen_elf.h"
+
+#if defined(X64)
+	#define GEN_MACHINE 62 // EM_X86_64
+	#define GEN_FLAGS 0
+	#define GEN_RELA 1
+	#define GEN_R_ABSOLUTE 1 // R_X86_64_64
+	#define GEN_R_GLOB_DAT 6
+	#define GEN_R_JUMP_SLOT 7
+	#define GEN_R_RELATIVE 8
+	#define GEN_R_COPY 5
+	#define GEN_R_IRELATIVE 37
+	#define GEN_R_PC_RELATIVE 2 // R_X86_64_PC32
+	static const uchar ret_insn[] = { 0xc3 }; // ret
+	static const uchar resolver_insn[] = { 0x48, 0x8d, 0x05, 0xf9, 0xff, 0xff, 0xff, 0xc3 }; // lea rax, [rip - 7]; ret
+#elif defined(X86)
+	#define GEN_MACHINE 3 // EM_386
+	#define GEN_FLAGS 0
+	#define GEN_RELA 0
+	#define GEN_R_ABSOLUTE 1 // R_386_32
+	#define GEN_R_GLOB_DAT 6
+	#define GEN_R_JUMP_SLOT 7
+	#define GEN_R_RELATIVE 8
+	#define GEN_R_COPY 5
+	#define GEN_R_IRELATIVE 42
+	#define GEN_R_PC_RELATIVE 2 // R_386_PC32
+	static const uchar ret_insn[] = { 0xc3 }; // ret
+	static const uchar resolver_insn[] = { 0xe8, 0, 0, 0, 0, 0x58, 0x83, 0xe8, 0x05, 0xc3 }; // call 1f; 1: pop eax; sub eax, 5; ret
+#elif defined(ARM64) || defined(AARCH64)
+	#define GEN_MACHINE 183 // EM_AARCH64
+	#define GEN_FLAGS 0
+	#define GEN_RELA 1
+	#define GEN_R_ABSOLUTE 257 // R_AARCH64_ABS64
+	#define GEN_R_GLOB_DAT 1025
+	#define GEN_R_JUMP_SLOT 1026
+	#define GEN_R_RELATIVE 1027
+	#define GEN_R_COPY 1024
+	#define GEN_R_IRELATIVE 1032
+	#define GEN_R_PC_RELATIVE 261 // R_AARCH64_PREL32
+	static const uchar ret_insn[] = { 0xc0, 0x03, 0x5f, 0xd6 }; // ret
+	static const uchar resolver_insn[] = { 0x00, 0x00, 0x00, 0x10, 0xc0, 0x03, 0x5f, 0xd6 }; // adr x0, .; ret
+#elif defined(ARM)
+	#define GEN_MACHINE 40 // EM_ARM
+	#define GEN_FLAGS 0x05000200 // EABI5, soft float
+	#define GEN_RELA 0
+	#define GEN_R_ABSOLUTE 2 // R_ARM_ABS32
+	#define GEN_R_GLOB_DAT 21
+	#define GEN_R_JUMP_SLOT 22
+	#define GEN_R_RELATIVE 23
+	#define GEN_R_COPY 20
+	#define GEN_R_IRELATIVE 160
+	#define GEN_R_PC_RELATIVE 3 // R_ARM_REL32
+	static const uchar ret_insn[] = { 0x1e, 0xff, 0x2f, 0xe1 }; // bx lr
+	static const uchar resolver_insn[] = { 0x08, 0x00, 0x4f, 0xe2, 0x1e, 0xff, 0x2f, 0xe1 }; // sub r0, pc, #8; bx lr
+#endif
+
+#if GEN_RELA
+	typedef elf_rela gen_rel;
+#else
+	typedef elf_rel gen_rel;
+#endif
+
+#ifdef __64__
+	#define gen_r_info(sym, type) (((size_t) (sym) << 32) | (type))
+#else
+	#define gen_r_info(sym, type) (((size_t) (sym) << 8) | (type))
+#endif
+
+#define GEN_REL_CLASSES 6 // in DT_RELA / DT_REL: relative, absolute, glob_dat, pc_relative, copy, irelative
+
+#define PAGE_ALIGN(x) (((x) + 0xfff) & ~(size_t) 0xfff)
+
+static uint sysv_hash(const char* name) {
+	uint h = 0;
+	for (; *name; name++) {
+		h = (h << 4) + (uchar) *name;
+		uint g = h & 0xf0000000;
+		if (g) h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+typedef struct {
+	char* name;
+	uint hash;
+	size_t value;
+	uchar info;
+	size_t size;
+} gen_sym;
+
+static size_t gnu_buckets;
+
+static int compare_bucket(const void* a, const void* b) {
+	uint x = ((const gen_sym*) a)->hash % gnu_buckets;
+	uint y = ((const gen_sym*) b)->hash % gnu_buckets;
+	return x < y ? -1 : x > y;
+}
+
+static void set_rel(gen_rel* rel, uchar* image, size_t offset, size_t info, size_t addend) {
+	rel->r_offset = offset;
+	rel->r_info = info;
+#if GEN_RELA
+	rel->r_addend = addend;
+#else
+	*(size_t*) (image + offset) = addend; // implicit addend
+#endif
+}
+
+int gen_elf(const char* path, const gen_elf_options* options) {
+	const size_t W = sizeof(size_t);
+	size_t imports = options->imports;
+	size_t defined = options->exports + options->text_pages;
+	size_t symoffset = 1 + imports; // undefined symbols first, they are not in DT_GNU_HASH
+	size_t nsyms = symoffset + defined;
+	size_t k = options->relocs;
+	size_t code_pages = options->text_pages + (k ? 1 : 0); // the last one holds the R_IRELATIVE resolver
+	int phnum = code_pages ? 5 : 4;
+
+	// names, exports sorted by gnu hash bucket
+	gen_sym* syms = (gen_sym*) calloc(nsyms, sizeof(gen_sym));
+	size_t strsz = 1;
+	char buf[256];
+	for (size_t i = 0; i < nsyms; i++) {
+		if (i == 0) {
+			buf[0] = 0;
+		} else if (i < symoffset) {
+			snprintf(buf, sizeof(buf), "%s%lu", options->import_prefix, (unsigned long) (i - 1));
+		} else if (i - symoffset < options->exports) {
+			snprintf(buf, sizeof(buf), "%s%lu", options->export_prefix, (unsigned long) (i - symoffset));
+		} else {
+			snprintf(buf, sizeof(buf), "%stext_%lu", options->export_prefix, (unsigned long) (i - symoffset - options->exports));
+		}
+		syms[i].name = strdup(buf);
+		syms[i].hash = symbol_hash(buf);
+		strsz += strlen(buf) + 1;
+	}
+	size_t soname_offset = strsz;
+	strsz += strlen(options->soname) + 1;
+	gnu_buckets = defined / 4 + 1;
+	size_t bloom_size = 1;
+	while (bloom_size * W * 8 < defined * 2) bloom_size <<= 1; // about 2 bits per symbol
+	uint bloom_shift = 6;
+	size_t sysv_buckets = nsyms / 2 + 1;
+
+	// read-only segment: headers, hash tables, symbols, strings, relocations
+	size_t off = sizeof(elf_header) + phnum * sizeof(elf_program_header);
+	size_t hash_off = off = (off + 7) & ~(size_t) 7;
+	off += (2 + sysv_buckets + nsyms) * sizeof(uint);
+	size_t gnu_hash_off = off = (off + W - 1) & ~(W - 1);
+	off += 4 * sizeof(uint) + bloom_size * W + (gnu_buckets + defined) * sizeof(uint);
+	size_t dynsym_off = off = (off + W - 1) & ~(W - 1);
+	off += nsyms * sizeof(elf_sym);
+	size_t dynstr_off = off;
+	off += strsz;
+	size_t rel_off = off = (off + W - 1) & ~(W - 1);
+	off += GEN_REL_CLASSES * k * sizeof(gen_rel);
+	size_t jmprel_off = off;
+	off += k * sizeof(gen_rel);
+	size_t text_off = PAGE_ALIGN(off);
+	size_t resolver_off = text_off + options->text_pages * 0x1000;
+	size_t data_off = text_off + code_pages * 0x1000;
+	size_t dyn_off = data_off;
+	size_t dyn_count = 20;
+	size_t exports_off = dyn_off + dyn_count * sizeof(elf_dyn);
+	size_t slots_off = exports_off + options->exports * W;
+	size_t size = slots_off + (GEN_REL_CLASSES + 1) * k * W;
+
+	uchar* image = (uchar*) calloc(size, 1);
+	elf_header* header = (elf_header*) image;
+	memcpy(header->e_ident, "\x7f" "ELF", 4);
+	header->e_ident[4] = W / 4; // ELFCLASS32 / ELFCLASS64
+	header->e_ident[5] = 1; // ELFDATA2LSB
+	header->e_ident[6] = 1; // EV_CURRENT
+	header->e_type = 3; // ET_DYN
+	header->e_machine = GEN_MACHINE;
+	header->e_version = 1;
+	header->e_phoff = sizeof(elf_header);
+	header->e_flags = GEN_FLAGS;
+	header->e_ehsize = sizeof(elf_header);
+	header->e_phentsize = sizeof(elf_program_header);
+	header->e_phnum = phnum;
+
+	elf_program_header* phdrs = (elf_program_header*) (image + sizeof(elf_header));
+	int ph = 0;
+	phdrs[ph].p_type = 1; // PT_LOAD
+	phdrs[ph].p_flags = 4; // PF_R
+	phdrs[ph].p_filesz = phdrs[ph].p_memsz = off;
+	phdrs[ph++].p_align = 0x1000;
+	if (code_pages) {
+		phdrs[ph].p_type = 1; // PT_LOAD
+		phdrs[ph].p_flags = 5; // PF_R | PF_X
+		phdrs[ph].p_offset = phdrs[ph].p_vaddr = phdrs[ph].p_paddr = text_off;
+		phdrs[ph].p_filesz = phdrs[ph].p_memsz = data_off - text_off;
+		phdrs[ph++].p_align = 0x1000;
+	}
+	phdrs[ph].p_type = 1; // PT_LOAD
+	phdrs[ph].p_flags = 6; // PF_R | PF_W
+	phdrs[ph].p_offset = phdrs[ph].p_vaddr = phdrs[ph].p_paddr = data_off;
+	phdrs[ph].p_filesz = phdrs[ph].p_memsz = size - data_off;
+	phdrs[ph++].p_align = 0x1000;
+	phdrs[ph].p_type = 2; // PT_DYNAMIC
+	phdrs[ph].p_flags = 6;
+	phdrs[ph].p_offset = phdrs[ph].p_vaddr = phdrs[ph].p_paddr = dyn_off;
+	phdrs[ph].p_filesz = phdrs[ph].p_memsz = dyn_count * sizeof(elf_dyn);
+	phdrs[ph++].p_align = W;
+	phdrs[ph].p_type = 0x6474e551; // PT_GNU_STACK, not executable
+	phdrs[ph].p_flags = 6;
+	phdrs[ph++].p_align = 0x10;
+
+	for (size_t i = symoffset; i < nsyms; i++) {
+		size_t n = i - symoffset;
+		if (n < options->exports) {
+			syms[i].value = exports_off + n * W;
+			syms[i].size = W;
+			syms[i].info = 0x11; // STB_GLOBAL, STT_OBJECT
+			*(size_t*) (image + syms[i].value) = n;
+		} else {
+			syms[i].value = text_off + (n - options->exports) * 0x1000;
+			syms[i].size = sizeof(ret_insn);
+			syms[i].info = 0x12; // STB_GLOBAL, STT_FUNC
+			memcpy(image + syms[i].value, ret_insn, sizeof(ret_insn));
+		}
+	}
+	for (size_t i = 1; i < symoffset; i++) {
+		syms[i].size = W; // as the exports of the image defining them, R_COPY copies this much
+		syms[i].info = 0x11; // STB_GLOBAL, STT_OBJECT
+	}
+	if (k) memcpy(image + resolver_off, resolver_insn, sizeof(resolver_insn));
+	qsort(syms + symoffset, defined, sizeof(gen_sym), compare_bucket);
+
+	// symbols and strings
+	elf_sym* dynsym = (elf_sym*) (image + dynsym_off);
+	char* dynstr = (char*) (image + dynstr_off);
+	size_t str = 1;
+	for (size_t i = 1; i < nsyms; i++) {
+		dynsym[i].st_name = str;
+		dynsym[i].st_value = syms[i].value;
+		dynsym[i].st_size = syms[i].size;
+		dynsym[i].st_info = syms[i].info;
+		dynsym[i].shndx = i < symoffset ? 0 : 1; // SHN_UNDEF or some section
+		strcpy(dynstr + str, syms[i].name);
+		str += strlen(syms[i].name) + 1;
+	}
+	strcpy(dynstr + soname_offset, options->soname);
+
+	// DT_HASH: nbucket, nchain, buckets, chains
+	uint* hash = (uint*) (image + hash_off);
+	hash[0] = sysv_buckets;
+	hash[1] = nsyms;
+	for (size_t i = nsyms - 1; i > 0; i--) {
+		uint b = sysv_hash(syms[i].name) % sysv_buckets;
+		hash[2 + sysv_buckets + i] = hash[2 + b];
+		hash[2 + b] = i;
+	}
+
+	// DT_GNU_HASH: nbuckets, symoffset, bloom_size, bloom_shift, bloom, buckets, chains
+	uint* gnu_hash = (uint*) (image + gnu_hash_off);
+	gnu_hash[0] = gnu_buckets;
+	gnu_hash[1] = symoffset;
+	gnu_hash[2] = bloom_size;
+	gnu_hash[3] = bloom_shift;
+	size_t* bloom = (size_t*) (gnu_hash + 4);
+	uint* buckets = (uint*) (bloom + bloom_size);
+	uint* chains = buckets + gnu_buckets;
+	for (size_t i = symoffset; i < nsyms; i++) {
+		uint h = syms[i].hash;
+		bloom[(h / (W * 8)) % bloom_size] |= ((size_t) 1 << (h % (W * 8))) | ((size_t) 1 << ((h >> bloom_shift) % (W * 8)));
+		uint b = h % gnu_buckets;
+		if (buckets[b] == 0) buckets[b] = i;
+		int last = i + 1 == nsyms || syms[i + 1].hash % gnu_buckets != b;
+		chains[i - symoffset] = (h & ~1) | last;
+	}
+
+	// relocations: relative first (DT_RELACOUNT), then absolute, glob_dat, pc_relative (against exports, in range),
+	// copy and irelative, jump_slot in DT_JMPREL
+	gen_rel* rel = (gen_rel*) (image + rel_off);
+	gen_rel* jmprel = (gen_rel*) (image + jmprel_off);
+	for (size_t i = 0; i < k; i++) {
+		size_t sym = imports ? 1 + i % imports : defined ? symoffset + i % defined : 0;
+		size_t local = defined ? symoffset + i % defined : 0;
+		size_t target = options->exports ? exports_off + (i % options->exports) * W : exports_off;
+		set_rel(&rel[i], image, slots_off + i * W, gen_r_info(0, GEN_R_RELATIVE), target);
+		set_rel(&rel[k + i], image, slots_off + (k + i) * W, gen_r_info(sym, GEN_R_ABSOLUTE), 0);
+		set_rel(&rel[2 * k + i], image, slots_off + (2 * k + i) * W, gen_r_info(sym, GEN_R_GLOB_DAT), 0);
+		set_rel(&rel[3 * k + i], image, slots_off + (3 * k + i) * W, gen_r_info(local, GEN_R_PC_RELATIVE), 0);
+		set_rel(&rel[4 * k + i], image, slots_off + (4 * k + i) * W, gen_r_info(sym, GEN_R_COPY), 0);
+		set_rel(&rel[5 * k + i], image, slots_off + (5 * k + i) * W, gen_r_info(0, GEN_R_IRELATIVE), resolver_off);
+		set_rel(&jmprel[i], image, slots_off + (6 * k + i) * W, gen_r_info(sym, GEN_R_JUMP_SLOT), 0);
+	}
+
+	elf_dyn* dyn = (elf_dyn*) (image + dyn_off);
+	size_t d = 0;
+	#define DYN(tag, value) do { dyn[d].d_tag = (tag); dyn[d].d_un = (value); d++; } while (0)
+	DYN(0xE, soname_offset); // DT_SONAME
+	DYN(4, hash_off); // DT_HASH
+	DYN(0x6ffffef5, gnu_hash_off); // DT_GNU_HASH
+	DYN(5, dynstr_off); // DT_STRTAB
+	DYN(0xA, strsz); // DT_STRSZ
+	DYN(6, dynsym_off); // DT_SYMTAB
+	DYN(0xB, sizeof(elf_sym)); // DT_SYMENT
+	if (k) {
+#if GEN_RELA
+		DYN(7, rel_off); // DT_RELA
+		DYN(8, GEN_REL_CLASSES * k * sizeof(gen_rel)); // DT_RELASZ
+		DYN(9, sizeof(gen_rel)); // DT_RELAENT
+		DYN(0x6ffffff9, k); // DT_RELACOUNT
+		DYN(0x14, 7); // DT_PLTREL: DT_RELA
+#else
+		DYN(0x11, rel_off); // DT_REL
+		DYN(0x12, GEN_REL_CLASSES * k * sizeof(gen_rel)); // DT_RELSZ
+		DYN(0x13, sizeof(gen_rel)); // DT_RELENT
+		DYN(0x6ffffffa, k); // DT_RELCOUNT
+		DYN(0x14, 0x11); // DT_PLTREL: DT_REL
+#endif
+		DYN(0x17, jmprel_off); // DT_JMPREL
+		DYN(2, k * sizeof(gen_rel)); // DT_PLTRELSZ
+	}
+	DYN(0x1e, 8); // DT_FLAGS: DF_BIND_NOW
+	DYN(0, 0); // DT_NULL
+	#undef DYN
+
+	int ok = 0;
+	FILE* f = fopen(path, "wb");
+	if (f) {
+		ok = fwrite(image, 1, size, f) == size;
+		ok &= fclose(f) == 0;
+	}
+	for (size_t i = 0; i < nsyms; i++) free(syms[i].name);
+	free(syms);
+	free(image);
+	return ok;
+}
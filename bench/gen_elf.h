@@ -0,0 +1,21 @@
+#ifndef __GEN_ELF_H__
+#define __GEN_ELF_H__
+
+#include <stddef.h>
+
+// synthetic shared object for the arch gen_elf is built for (-D X64 / X86 / ARM64 / ARM),
+// with DT_HASH, DT_GNU_HASH and DF_BIND_NOW, no code other than the text pages and an R_IRELATIVE resolver
+
+typedef struct {
+	const char* soname;
+	const char* export_prefix; // <export_prefix><i>: pointer sized object holding i
+	size_t exports;
+	const char* import_prefix; // <import_prefix><i>: undefined pointer sized objects, absolute/glob_dat/copy/jump_slot relocations use them (or the exports if none)
+	size_t imports;
+	size_t relocs; // of each class: relative (counted by DT_RELACOUNT/DT_RELCOUNT), absolute, glob_dat, pc_relative, copy, irelative, jump_slot. no tls, load_elf doesn't support it
+	size_t text_pages; // <export_prefix>text_<i>: function returning at the start of executable page i
+} gen_elf_options;
+
+int gen_elf(const char* path, const gen_elf_options* options); // 0 on error
+
+#endif
@@ -1,12 +1,108 @@
 #ifndef __LOAD_ELF_H__
 #define __LOAD_ELF_H__
 
+#include <stddef.h>
+#include <sys/types.h>
+
 void* load_elf(const char* elf_path);
-void* get_symbol_by_name(void* base, const char* symbol);
+void* load_elf_fd(int fd, off_t offset, size_t size); // elf stored at offset of fd (size 0: to the end), mapped without copy if offset is page aligned
+void* load_elf_mem(const void* buf, size_t len); // elf in memory, segments are copied
+int load_elfs(const char** paths, void** bases, size_t n, int threads); // mapped and relocated in parallel (threads <= 0: one per cpu), each after the ones it needs, then init in that order. returns how many loaded, (void*) -1 in bases for the others
+int unload_elf(void* base); // drop a reference, the last one runs fini (through init_array_filter) and unmaps the image. 0 if base was not loaded with mmap
+void* get_symbol_by_name(void* base, const char* symbol); // DT_SYMTAB, then the .symtab of images loaded from a file with mmap (static ones included)
 void* get_symbol_by_offset(void* base, size_t offset);
+
+// dynamic section and program headers of a loaded image, parsed once.
+// pointers are absolute, NULL (count 0) if absent; elf types are in elf_struct.h
+typedef struct loaded_image {
+	void* base;
+	const void* dyn; // elf_dyn[], NULL for static images
+	const char* strtab;
+	size_t strsz;
+	const void* symtab; // elf_sym[]
+	size_t symbol_count; // from the hash tables
+	const unsigned int* gnu_hash;
+	const unsigned int* sysv_hash;
+	const void* rela; // elf_rela[], after the relative ones
+	size_t rela_count;
+	const void* relative_rela; // DT_RELACOUNT leading relative entries
+	size_t relative_rela_count;
+	const void* rel; // elf_rel[], same as rela
+	size_t rel_count;
+	const void* relative_rel;
+	size_t relative_rel_count;
+	const void* jmprel; // elf_rela[] or elf_rel[]
+	size_t jmprel_count;
+	int jmprel_is_rela;
+	const size_t* relr; // DT_RELR or DT_ANDROID_RELR
+	size_t relr_count;
+	const unsigned char* android_rela; // DT_ANDROID_RELA, packed
+	size_t android_rela_size;
+	const unsigned char* android_rel;
+	size_t android_rel_size;
+	size_t* pltgot;
+	int bind_now; // DT_BIND_NOW, DF_BIND_NOW or DF_1_NOW
+	int textrel; // DT_TEXTREL or DF_TEXTREL
+	const char* soname;
+	const char* rpath;
+	const char* runpath;
+	void (*init)();
+	void (**init_array)();
+	size_t init_array_count;
+	void (*fini)();
+	void (**fini_array)();
+	size_t fini_array_count;
+	const void* tls_image; // PT_TLS
+	size_t tls_filesz;
+	size_t tls_memsz;
+	size_t tls_align;
+	void* relro; // PT_GNU_RELRO, whole pages
+	size_t relro_size;
+} loaded_image;
+const loaded_image* load_elf_ex(const char* elf_path); // load_elf, returns its parsed image
+const loaded_image* get_loaded_image(void* base); // parsed on first use if not loaded with mmap (dlopen...), again if dlclosed since (see invalidate_symbol_cache), NULL if it can't be parsed
+void* get_image_symbol(const loaded_image* image, const char* symbol); // DT_SYMTAB only
+int lookup_address(const void* addr, const char** name, size_t* offset); // symbol containing addr (DT_SYMTAB and .symtab of images loaded with mmap, else dladdr), name valid while loaded. 0 if none
 void register_global_symbol(const char* symbol, void* target); // register symbols before load_elf
+void register_global_symbols(const char** symbols, void** targets, size_t count); // register_global_symbol for each pair
+void set_load_base(void* base); // where pie images are loaded, default 0xc0000000 (stepping 16MB if used), NULL: chosen by kernel
+#define LOAD_HUGEPAGE 1 // 2MB aligned base, executable segments of at least 2MB are copied to MADV_HUGEPAGE memory
+#define LOAD_POPULATE 2 // prefault read-only segments (MAP_POPULATE), readahead writable ones (MADV_WILLNEED)
+void set_load_options(int options); // LOAD_* flags for load_with_mmap, default 0
+void set_lazy_binding(int enable); // default off, bind plt entries on first call instead of in load_elf
+void set_reloc_threads(int threads); // relocation tables of 8192+ entries are split across threads (0: one per cpu), default 1
+void set_library_search_path(const char* path); // ':' separated, searched for DT_NEEDED dlopen can't load, after DT_RPATH and before DT_RUNPATH
 void load_global_library(const char* libname); // dlopen or load_elf
 void* get_global_symbol(const char* symbol); // register_global_symbol or dlsym or get_symbol_by_name(loaded_global_library, symbol)
+void get_symbol_cache_stats(size_t* hits, size_t* misses); // get_global_symbol results are cached, including misses
+void invalidate_symbol_cache(); // call after dlopen outside load_elf if new symbols should be visible, after dlclose so that get_loaded_image checks its images again
+
+#define LOAD_STATS_MAX_SEGMENTS 16
+#define LOAD_STATS_RELOC_CLASSES 10 // unknown, none, absolute, relative, glob_dat, jump_slot, copy, irelative, pc_relative, tls
+typedef struct load_stats {
+	unsigned long long total_ns;
+	unsigned long long header_ns; // read and check elf header and program headers
+	unsigned long long reserve_ns;
+	unsigned long long mmap_ns;
+	unsigned long long segment_ns[LOAD_STATS_MAX_SEGMENTS]; // each PT_LOAD, the first LOAD_STATS_MAX_SEGMENTS
+	size_t segment_count;
+	unsigned long long needed_ns; // including DT_NEEDED loaded with mmap
+	unsigned long long reloc_ns;
+	unsigned long long init_ns;
+	unsigned long long fini_scan_ns;
+	size_t relocs[LOAD_STATS_RELOC_CLASSES];
+	size_t symbol_cache_hits;
+	size_t symbols_registered; // register_global_symbol
+	size_t symbols_dlsym;
+	size_t symbols_library; // libraries loaded with mmap
+	size_t symbols_unresolved;
+	size_t pages; // reserved for the image
+	size_t pages_dirtied; // counted by the first get_load_stats after the load, 0 if the image was unloaded before
+} load_stats;
+const load_stats* get_load_stats(); // of the last image loaded with mmap by this thread
+void print_load_stats(const load_stats* stats); // as json, one line
+int save_image_snapshot(void* base, const char* path); // save relocated pie image, load it with init_array_filter skipping everything
+void* load_image_snapshot(const char* path); // map snapshot at the saved base, re-resolve external symbols and run init, NULL on failure
 
 extern int (*init_array_filter)(void* base, void (*init_array_item)());
 
@@ -0,0 +1,51 @@
+#ifndef __LOAD_ELF_INTERNAL_H__
+#define __LOAD_ELF_INTERNAL_H__
+
+// shared by the loader sources, not part of the api
+
+#include "elf_struct.h"
+#include "load_elf.h"
+#include "reloc.h"
+
+#define BADADDR ((void*) -1)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+const elf_dyn* get_dyn(void* base);
+const elf_dyn* find_dyn_entry(const elf_dyn* dyn, int type);
+void* load_with_mmap(const char* path);
+void set_defer_init(int defer); // the next load_dynamic on this thread leaves run_init to the caller
+void publish_library(const char* libname, void* base); // DT_NEEDED of later images, by libname and DT_SONAME
+void record_loaded_library(const loaded_image* image, const char* path); // by file name and DT_SONAME, if no library of that name is loaded
+void lock_loader(); // recursive, guards the loader lists, no loaded code runs while it is held
+void unlock_loader();
+void lock_init(); // recursive, init and fini calls and library loading, taken before lock_loader
+void unlock_init();
+void load_needed_libraries(const loaded_image* image, const char* path); // DT_NEEDED of the image, path for $ORIGIN
+typedef int (*reloc_visitor)(void* arg, void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab);
+int for_each_reloc(const loaded_image* image, reloc_visitor fn, void* arg);
+void run_init(const loaded_image* image);
+void run_fini(const loaded_image* image);
+int parse_image(loaded_image* image, void* base, const elf_dyn* dyn, const elf_program_header* phdrs, int phnum); // 0 if the tables are malformed
+const loaded_image* register_image(void* start, size_t span, const loaded_image* image, const char* path); // copied, for unload_elf, refcount 1
+void retain_image(void* base);
+const loaded_image* find_loaded_image(void* base); // registered by load_with_mmap or load_image_snapshot, NULL otherwise
+void discard_image(void* base); // drop the record of an image that failed to load
+int segment_prot(uint p_flags); // PF_* to PROT_*
+void protect_relro(const loaded_image* image);
+size_t count_dirty_pages(void* addr, size_t size); // from /proc/self/pagemap
+ullong stats_now(); // CLOCK_MONOTONIC ns
+load_stats* current_load_stats(); // this thread's, of the image being loaded
+void enter_load_stats(load_stats* outer); // outer saved if nested (DT_NEEDED)
+void leave_load_stats(const load_stats* outer);
+void set_load_stats_pages(void* start, size_t size); // pages_dirtied counted later, by get_load_stats
+typedef struct SymbolIndex SymbolIndex; // symbol_index.c
+SymbolIndex* build_symbol_index(const loaded_image* image, const char* path); // path: .symtab read from the file too
+void free_symbol_index(SymbolIndex* index);
+int find_address_symbol(SymbolIndex* index, size_t addr, const char** name, size_t* offset); // address index built on first call
+const elf_sym* find_file_symbol(SymbolIndex* index, const char* symbol); // .symtab by name, name index built on first call
+const void** file_ifunc_target(SymbolIndex* index, const elf_sym* sym); // cached resolver result of a find_file_symbol ifunc, NULL if out of memory
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __RELOC_H__
+#define __RELOC_H__
+
+#include "elf_struct.h"
+
+// relocation engine (src/do_reloc.c)
+// every relocation type of the arch maps to one class, each class has its own apply function
+
+typedef enum {
+	RELOC_UNKNOWN = 0, // not in reloc table
+	RELOC_NONE,
+	RELOC_ABSOLUTE, // S + A
+	RELOC_RELATIVE, // B + A
+	RELOC_GLOB_DAT, // S
+	RELOC_JUMP_SLOT, // S
+	RELOC_COPY, // memcpy(P, S, st_size)
+	RELOC_IRELATIVE, // ((*)()) (B + A) ()
+	RELOC_PC_RELATIVE, // S + A - P
+	RELOC_TLS, // not supported
+	RELOC_CLASS_COUNT
+} reloc_class;
+
+typedef struct {
+	uchar cls; // reloc_class
+	uchar width; // bytes written at P
+	const char* name;
+} reloc_desc;
+
+typedef int (*reloc_fn)(void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab);
+
+int do_reloc(void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab);
+int do_lazy_reloc(void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab);
+size_t do_rela_batch(void* base, const elf_rela* rela, size_t count, const elf_sym* symtab, const char* strtab); // leading run of one side effect free type, 0 if rela[0] needs do_reloc
+size_t do_rel_batch(void* base, const elf_rel* rel, size_t count, const elf_sym* symtab, const char* strtab);
+void lazy_bind_trampoline();
+const reloc_desc* find_reloc_desc(size_t info);
+size_t call_ifunc_resolver(size_t resolver); // with AT_HWCAP (and AT_HWCAP2) as the arch abi passes them
+
+// load_elf.c
+const void* resolve_symbol(const elf_sym* symtab, const char* strtab, size_t sym);
+const void* resolve_ifunc_symbol(void* base, const elf_sym* symtab, size_t sym); // STT_GNU_IFUNC defined in the image, resolver called once
+void count_reloc(int cls, size_t count); // load_stats
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef __SYMBOL_TABLE_H__
+#define __SYMBOL_TABLE_H__
+
+#include <stddef.h>
+
+// open addressing (linear probing) hash table: symbol name -> address
+// symbol names are not copied, they must stay valid while in the table
+
+typedef struct SymbolEntry {
+	const char* symbol; // NULL: empty slot
+	void* addr;
+	unsigned int hash;
+} SymbolEntry;
+
+typedef struct SymbolTable {
+	SymbolEntry* entries;
+	size_t capacity; // 0 or power of 2
+	size_t count;
+} SymbolTable;
+
+unsigned int symbol_hash(const char* symbol); // same hash as DT_GNU_HASH
+
+SymbolEntry* symbol_table_find(const SymbolTable* table, const char* symbol); // NULL if not found
+SymbolEntry* symbol_table_insert(SymbolTable* table, const char* symbol, int* inserted); // existing entry or a new one with addr NULL
+void symbol_table_reserve(SymbolTable* table, size_t count);
+void symbol_table_clear(SymbolTable* table);
+
+#endif
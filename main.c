@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <string.h>
 #include "load_elf.h"
 #include "logger.h"
 #include "breakpoint.h"
@@ -22,7 +23,7 @@ int filter() {
 	return 1;
 }
 
-int main() {
+int main(int argc, char** argv) {
 	// SET_LOGV();
 
 	init_array_filter = (void*) filter;
@@ -41,6 +42,9 @@ int main() {
 
 	const char* path = "/lib/x86_64-linux-gnu/libc++.so.1";
 	void* base = load_elf(path);
+	if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+		print_load_stats(get_load_stats());
+	}
 	void* std_cout = get_symbol_by_name(base, "_ZNSt3__14coutE");
 	// offset may be different
 	// std::ostream::operator<<(int)
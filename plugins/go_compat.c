@@ -17,6 +17,7 @@ void call_go_func(void* func, void* out, size_t out_count, ...); // assume out_c
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #define USER_STACK_SIZE (0x100000 - 0x100)
 // addr1:
@@ -260,6 +261,15 @@ static void __attribute__((naked)) main_main_stub() {
 		"mov rax, [rip + go_ctx + 0x38]\n" // rsp
 		"mov rax, [rax + 8]\n" // go runtime retaddr
 		"mov [rip + addr2], rax\n"
+		// text is mapped read-only, make the patched bytes writable
+		"push rax\n"
+		"mov rdi, rax\n"
+		"and rdi, -0x1000\n"
+		"mov esi, 0x2000\n" // 16 bytes may cross a page
+		"mov edx, 7\n" // PROT_READ | PROT_WRITE | PROT_EXEC
+		"mov eax, 10\n" // SYS_mprotect
+		"syscall\n"
+		"pop rax\n"
 		"push [rax + 8]\n"
 		"push [rax]\n"
 		"pop [rip + saved_go_ins]\n"
@@ -297,6 +307,8 @@ void __attribute((noreturn)) go_compat_entry(void* entry, void* main_ptr_in_elf,
 	// before main_main_stub, it's saved user stack
 	addr1 = (void*) ((((size_t) malloc(USER_STACK_SIZE) + USER_STACK_SIZE) & ~0xff) - 0x18);
 	addr2 = main_main;
+	// main_ptr_in_elf is in .rodata, which is mapped read-only
+	mprotect((void*) ((size_t) main_ptr_in_elf & ~0xfff), 0x1000, PROT_READ | PROT_WRITE);
 	*(void**) main_ptr_in_elf = main_main_stub;
 	enter_go_entry(entry);
 
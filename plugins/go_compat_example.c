@@ -13,7 +13,7 @@ int filter() {
 void* base;
 void main_main() {
 	printf("Enter main_main: %p;\n", main_main);
-	call_go_func(get_symbol_by_offset(base, 0x48c460), NULL, 0);
+	call_go_func(get_symbol_by_name(base, "main.main"), NULL, 0);
 	putchar('\n');
 	printf("Exit  main_main: %p;\n", main_main);
 }
@@ -25,7 +25,7 @@ int main() {
 	const char* path = "./plugins/go_linux.bak";
 	base = load_elf(path);
 
-	void* go_entry = get_symbol_by_offset(base, 0x45c600);
+	void* go_entry = get_symbol_by_name(base, "_rt0_amd64_linux");
 	void* ptr = get_symbol_by_offset(base, 0x4ac450);
 	go_compat_entry(go_entry, ptr, main_main);
 
@@ -0,0 +1,484 @@
+#include <stddef.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include "elf_struct.h"
+#include "logger.h"
+#include "load_elf.h"
+#include "reloc.h"
+
+// reloc_table[type]: { class, width, name }, types not listed are RELOC_UNKNOWN
+// lazy_bind_trampoline: plt0 jumps here through GOT[2], see do_lazy_reloc
+
+#if defined(X64)
+static const reloc_desc reloc_table[] = {
+	[0] = { RELOC_NONE, 0, "R_X86_64_NONE" },
+	[1] = { RELOC_ABSOLUTE, 8, "R_X86_64_64" },
+	[2] = { RELOC_PC_RELATIVE, 4, "R_X86_64_PC32" },
+	[5] = { RELOC_COPY, 0, "R_X86_64_COPY" },
+	[6] = { RELOC_GLOB_DAT, 8, "R_X86_64_GLOB_DAT" },
+	[7] = { RELOC_JUMP_SLOT, 8, "R_X86_64_JUMP_SLOT" },
+	[8] = { RELOC_RELATIVE, 8, "R_X86_64_RELATIVE" },
+	[10] = { RELOC_ABSOLUTE, 4, "R_X86_64_32" },
+	[11] = { RELOC_ABSOLUTE, 4, "R_X86_64_32S" },
+	[16] = { RELOC_TLS, 8, "R_X86_64_DTPMOD64" },
+	[17] = { RELOC_TLS, 8, "R_X86_64_DTPOFF64" },
+	[18] = { RELOC_TLS, 8, "R_X86_64_TPOFF64" },
+	[24] = { RELOC_PC_RELATIVE, 8, "R_X86_64_PC64" },
+	[37] = { RELOC_IRELATIVE, 8, "R_X86_64_IRELATIVE" },
+};
+
+// [rsp] = GOT[1], [rsp + 8] = jmprel index, [rsp + 16] = return address
+// argument registers are saved (xmm0-7 only, no ymm/zmm)
+// extended asm so that {att|intel} picks the syntax, go_compat builds with -masm=intel
+static void __attribute__((used)) define_lazy_bind_trampoline() {
+	asm volatile(
+		"{|.att_syntax prefix\n\t}"
+		".pushsection .text\n"
+		".globl lazy_bind_trampoline\n"
+		".type lazy_bind_trampoline, @function\n"
+		"lazy_bind_trampoline:\n"
+		"push %%rax\n"
+		"push %%rdi\n"
+		"push %%rsi\n"
+		"push %%rdx\n"
+		"push %%rcx\n"
+		"push %%r8\n"
+		"push %%r9\n"
+		"sub $128, %%rsp\n" // rsp is 16 bytes aligned here
+		"movdqu %%xmm0, 0(%%rsp)\n"
+		"movdqu %%xmm1, 16(%%rsp)\n"
+		"movdqu %%xmm2, 32(%%rsp)\n"
+		"movdqu %%xmm3, 48(%%rsp)\n"
+		"movdqu %%xmm4, 64(%%rsp)\n"
+		"movdqu %%xmm5, 80(%%rsp)\n"
+		"movdqu %%xmm6, 96(%%rsp)\n"
+		"movdqu %%xmm7, 112(%%rsp)\n"
+		"mov 184(%%rsp), %%rdi\n"
+		"mov 192(%%rsp), %%rsi\n"
+		"call lazy_bind_fixup@PLT\n"
+		"mov %%rax, %%r11\n"
+		"movdqu 0(%%rsp), %%xmm0\n"
+		"movdqu 16(%%rsp), %%xmm1\n"
+		"movdqu 32(%%rsp), %%xmm2\n"
+		"movdqu 48(%%rsp), %%xmm3\n"
+		"movdqu 64(%%rsp), %%xmm4\n"
+		"movdqu 80(%%rsp), %%xmm5\n"
+		"movdqu 96(%%rsp), %%xmm6\n"
+		"movdqu 112(%%rsp), %%xmm7\n"
+		"add $128, %%rsp\n"
+		"pop %%r9\n"
+		"pop %%r8\n"
+		"pop %%rcx\n"
+		"pop %%rdx\n"
+		"pop %%rsi\n"
+		"pop %%rdi\n"
+		"pop %%rax\n"
+		"add $16, %%rsp\n"
+		"jmp *%%r11\n"
+		".size lazy_bind_trampoline, .-lazy_bind_trampoline\n"
+		".popsection\n"
+		"{|.intel_syntax noprefix\n\t}"
+		: : :
+	);
+}
+
+#elif defined(X86)
+static const reloc_desc reloc_table[] = {
+	[0] = { RELOC_NONE, 0, "R_386_NONE" },
+	[1] = { RELOC_ABSOLUTE, 4, "R_386_32" },
+	[2] = { RELOC_PC_RELATIVE, 4, "R_386_PC32" },
+	[5] = { RELOC_COPY, 0, "R_386_COPY" },
+	[6] = { RELOC_GLOB_DAT, 4, "R_386_GLOB_DAT" },
+	[7] = { RELOC_JUMP_SLOT, 4, "R_386_JMP_SLOT" },
+	[8] = { RELOC_RELATIVE, 4, "R_386_RELATIVE" },
+	[14] = { RELOC_TLS, 4, "R_386_TLS_TPOFF" },
+	[35] = { RELOC_TLS, 4, "R_386_TLS_DTPMOD32" },
+	[36] = { RELOC_TLS, 4, "R_386_TLS_DTPOFF32" },
+	[37] = { RELOC_TLS, 4, "R_386_TLS_TPOFF32" },
+	[42] = { RELOC_IRELATIVE, 4, "R_386_IRELATIVE" },
+};
+
+// (%esp) = GOT[1], 4(%esp) = byte offset in jmprel, 8(%esp) = return address
+asm(
+	".text\n"
+	".globl lazy_bind_trampoline\n"
+	".type lazy_bind_trampoline, @function\n"
+	"lazy_bind_trampoline:\n"
+	"push %eax\n"
+	"push %ecx\n"
+	"push %edx\n"
+	"mov 16(%esp), %edx\n"
+	"mov 12(%esp), %eax\n"
+	"shr $3, %edx\n" // sizeof(elf_rel)
+	"push %edx\n"
+	"push %eax\n"
+	"call lazy_bind_fixup\n"
+	"add $8, %esp\n"
+	"pop %edx\n"
+	"pop %ecx\n"
+	"xchg %eax, (%esp)\n" // restore eax, target on stack
+	"ret $8\n"
+	".size lazy_bind_trampoline, .-lazy_bind_trampoline\n"
+);
+
+#elif defined(ARM)
+static const reloc_desc reloc_table[] = {
+	[0] = { RELOC_NONE, 0, "R_ARM_NONE" },
+	[2] = { RELOC_ABSOLUTE, 4, "R_ARM_ABS32" },
+	[3] = { RELOC_PC_RELATIVE, 4, "R_ARM_REL32" },
+	[17] = { RELOC_TLS, 4, "R_ARM_TLS_DTPMOD32" },
+	[18] = { RELOC_TLS, 4, "R_ARM_TLS_DTPOFF32" },
+	[19] = { RELOC_TLS, 4, "R_ARM_TLS_TPOFF32" },
+	[20] = { RELOC_COPY, 0, "R_ARM_COPY" },
+	[21] = { RELOC_GLOB_DAT, 4, "R_ARM_GLOB_DAT" },
+	[22] = { RELOC_JUMP_SLOT, 4, "R_ARM_JUMP_SLOT" },
+	[23] = { RELOC_RELATIVE, 4, "R_ARM_RELATIVE" },
+	[160] = { RELOC_IRELATIVE, 4, "R_ARM_IRELATIVE" },
+};
+
+// ip = &GOT[n], lr = &GOT[2], [sp] = return address
+// jump slot n is jmprel entry n - 3, as ld.so assumes
+asm(
+	".text\n"
+	".arm\n"
+	".globl lazy_bind_trampoline\n"
+	".type lazy_bind_trampoline, %function\n"
+	"lazy_bind_trampoline:\n"
+	"push {r0-r4}\n" // r4 keeps sp 8 bytes aligned
+#ifdef __ARM_PCS_VFP
+	"vpush {d0-d7}\n"
+#endif
+	"ldr r0, [lr, #-4]\n"
+	"sub r1, ip, lr\n"
+	"sub r1, r1, #4\n"
+	"lsr r1, r1, #2\n"
+	"bl lazy_bind_fixup\n"
+	"mov ip, r0\n"
+#ifdef __ARM_PCS_VFP
+	"vpop {d0-d7}\n"
+#endif
+	"pop {r0-r4, lr}\n"
+	"bx ip\n"
+	".size lazy_bind_trampoline, .-lazy_bind_trampoline\n"
+);
+
+#elif defined(ARM64) || defined(AARCH64)
+static const reloc_desc reloc_table[] = {
+	[0] = { RELOC_NONE, 0, "R_AARCH64_NONE" },
+	[256] = { RELOC_NONE, 0, "R_AARCH64_NONE" },
+	[257] = { RELOC_ABSOLUTE, 8, "R_AARCH64_ABS64" },
+	[258] = { RELOC_ABSOLUTE, 4, "R_AARCH64_ABS32" },
+	[260] = { RELOC_PC_RELATIVE, 8, "R_AARCH64_PREL64" },
+	[261] = { RELOC_PC_RELATIVE, 4, "R_AARCH64_PREL32" },
+	[1024] = { RELOC_COPY, 0, "R_AARCH64_COPY" },
+	[1025] = { RELOC_GLOB_DAT, 8, "R_AARCH64_GLOB_DAT" },
+	[1026] = { RELOC_JUMP_SLOT, 8, "R_AARCH64_JUMP_SLOT" },
+	[1027] = { RELOC_RELATIVE, 8, "R_AARCH64_RELATIVE" },
+	[1028] = { RELOC_TLS, 8, "R_AARCH64_TLS_DTPMOD" },
+	[1029] = { RELOC_TLS, 8, "R_AARCH64_TLS_DTPREL" },
+	[1030] = { RELOC_TLS, 8, "R_AARCH64_TLS_TPREL" },
+	[1031] = { RELOC_TLS, 8, "R_AARCH64_TLSDESC" },
+	[1032] = { RELOC_IRELATIVE, 8, "R_AARCH64_IRELATIVE" },
+};
+
+// x16 = &GOT[2], [sp] = &GOT[n], [sp + 8] = x30 of caller
+// jump slot n is jmprel entry n - 3, as ld.so assumes
+asm(
+	".text\n"
+	".globl lazy_bind_trampoline\n"
+	".type lazy_bind_trampoline, %function\n"
+	"lazy_bind_trampoline:\n"
+	"sub sp, sp, #208\n"
+	"stp x0, x1, [sp, #0]\n"
+	"stp x2, x3, [sp, #16]\n"
+	"stp x4, x5, [sp, #32]\n"
+	"stp x6, x7, [sp, #48]\n"
+	"str x8, [sp, #64]\n"
+	"stp q0, q1, [sp, #80]\n"
+	"stp q2, q3, [sp, #112]\n"
+	"stp q4, q5, [sp, #144]\n"
+	"stp q6, q7, [sp, #176]\n"
+	"ldr x0, [x16, #-8]\n"
+	"ldr x1, [sp, #208]\n"
+	"sub x1, x1, x16\n"
+	"sub x1, x1, #8\n"
+	"lsr x1, x1, #3\n"
+	"bl lazy_bind_fixup\n"
+	"mov x16, x0\n"
+	"ldp q6, q7, [sp, #176]\n"
+	"ldp q4, q5, [sp, #144]\n"
+	"ldp q2, q3, [sp, #112]\n"
+	"ldp q0, q1, [sp, #80]\n"
+	"ldr x8, [sp, #64]\n"
+	"ldp x6, x7, [sp, #48]\n"
+	"ldp x4, x5, [sp, #32]\n"
+	"ldp x2, x3, [sp, #16]\n"
+	"ldp x0, x1, [sp, #0]\n"
+	"add sp, sp, #208\n"
+	"ldp x17, x30, [sp], #16\n"
+	"br x16\n"
+	".size lazy_bind_trampoline, .-lazy_bind_trampoline\n"
+);
+
+#else
+	#error "invalid arch"
+#endif
+
+#define RELOC_TABLE_SIZE (sizeof(reloc_table) / sizeof(reloc_table[0]))
+
+static const reloc_desc unknown_reloc = { RELOC_UNKNOWN, 0, "unknown" };
+
+static inline const reloc_desc* get_reloc_desc(uint type) {
+	return type < RELOC_TABLE_SIZE ? &reloc_table[type] : &unknown_reloc;
+}
+
+const reloc_desc* find_reloc_desc(size_t info) {
+	return get_reloc_desc(elf_r_type(info));
+}
+
+static inline void write_reloc(void* base, size_t offset, size_t value, int width) {
+	if (width == 4) {
+		*(uint*) ((size_t) base + offset) = (uint) value;
+	} else {
+		*(size_t*) ((size_t) base + offset) = value;
+	}
+}
+
+// arguments ld.so passes to ifunc resolvers of the arch
+size_t call_ifunc_resolver(size_t resolver) {
+#if defined(ARM64) || defined(AARCH64)
+	// x0: hwcap | _IFUNC_ARG_HWCAP, x1: __ifunc_arg_t
+	struct { size_t size; ullong hwcap; ullong hwcap2; } arg = { sizeof(arg), getauxval(AT_HWCAP), getauxval(AT_HWCAP2) };
+	return ((size_t (*)(ullong, const void*)) resolver)(arg.hwcap | (1ULL << 62), &arg);
+#elif defined(ARM)
+	return ((size_t (*)(unsigned long)) resolver)(getauxval(AT_HWCAP));
+#else
+	return ((size_t (*)()) resolver)(); // x86 resolvers read cpu features themselves
+#endif
+}
+
+// S: symbols defined in image are relative to base (ifunc: resolved target), the others are resolved globally
+static inline size_t symbol_address(void* base, size_t info, const elf_sym* symtab, const char* strtab) {
+	size_t sym = elf_r_sym(info);
+	if (symtab[sym].st_value) {
+		if (elf_st_type(symtab[sym].st_info) == 10) { // STT_GNU_IFUNC
+			return (size_t) resolve_ifunc_symbol(base, symtab, sym);
+		}
+		return (size_t) base + symtab[sym].st_value;
+	}
+	const void* sym_value = resolve_symbol(symtab, strtab, sym);
+	if (!sym_value) {
+		LOGW("failed to resolve symbol `%s'.\n", strtab + symtab[sym].st_name);
+	}
+	return (size_t) sym_value;
+}
+
+#define RELOC_ARGS void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab, const reloc_desc* desc
+#define sym (elf_r_sym(info))
+#define sym_name (strtab + symtab[sym].st_name)
+
+static int apply_unknown(RELOC_ARGS) {
+	LOGW("unimplemented reloc type: %d.\n", (int) elf_r_type(info));
+	return 1;
+}
+
+static int apply_none(RELOC_ARGS) {
+	LOGV("%s.\n", desc->name);
+	return 1;
+}
+
+static int apply_absolute(RELOC_ARGS) {
+	LOGV("%s: set `%s'+0x%lx at +0x%lx.\n", desc->name, sym_name, addend, offset);
+	size_t value = symbol_address(base, info, symtab, strtab);
+	if (value) write_reloc(base, offset, value + addend, desc->width);
+	return 1;
+}
+
+static int apply_relative(RELOC_ARGS) {
+	LOGV("%s: set +0x%lx at +0x%lx.\n", desc->name, addend, offset);
+	write_reloc(base, offset, (size_t) base + addend, desc->width);
+	return 1;
+}
+
+static int apply_glob_dat(RELOC_ARGS) {
+	LOGV("%s: set `%s' at +0x%lx.\n", desc->name, sym_name, offset);
+	size_t value = symbol_address(base, info, symtab, strtab);
+	if (value) write_reloc(base, offset, value, desc->width);
+	return 1;
+}
+
+static int apply_copy(RELOC_ARGS) {
+	size_t value = symtab[sym].st_value;
+	size_t size = symtab[sym].st_size;
+	if (value && offset != value) {
+		LOGV("%s: from +0x%lx to +0x%lx size 0x%lx.\n", desc->name, value, offset, size);
+		memcpy((void*) ((size_t) base + offset), (const void*) ((size_t) base + value), size);
+		return 1;
+	}
+	if (value) {
+		LOGE("Maybe unspecified R_COPY at +0x%lx size 0x%lx.\n", offset, size);
+	}
+	LOGV("%s: from `%s' to +0x%lx size 0x%lx.\n", desc->name, sym_name, offset, size);
+	const void* sym_value = resolve_symbol(symtab, strtab, sym);
+	if (!sym_value) {
+		LOGW("failed to resolve symbol `%s'.\n", sym_name);
+		return 1;
+	}
+	memcpy((void*) ((size_t) base + offset), sym_value, size);
+	return 1;
+}
+
+static int apply_irelative(RELOC_ARGS) {
+	LOGV("%s: set (+0x%lx)() at +0x%lx.\n", desc->name, addend, offset);
+	write_reloc(base, offset, call_ifunc_resolver((size_t) base + addend), desc->width);
+	return 1;
+}
+
+static int apply_pc_relative(RELOC_ARGS) {
+	LOGV("%s: set `%s'+0x%lx-P at +0x%lx.\n", desc->name, sym_name, addend, offset);
+	size_t value = symbol_address(base, info, symtab, strtab);
+	if (value) write_reloc(base, offset, value + addend - ((size_t) base + offset), desc->width);
+	return 1;
+}
+
+static int apply_tls(RELOC_ARGS) {
+	LOGW("unsupported TLS relocation %s at +0x%lx.\n", desc->name, offset);
+	return 1;
+}
+
+#undef sym
+#undef sym_name
+
+static int (* const reloc_handlers[RELOC_CLASS_COUNT])(RELOC_ARGS) = {
+	[RELOC_UNKNOWN] = apply_unknown,
+	[RELOC_NONE] = apply_none,
+	[RELOC_ABSOLUTE] = apply_absolute,
+	[RELOC_RELATIVE] = apply_relative,
+	[RELOC_GLOB_DAT] = apply_glob_dat,
+	[RELOC_JUMP_SLOT] = apply_glob_dat,
+	[RELOC_COPY] = apply_copy,
+	[RELOC_IRELATIVE] = apply_irelative,
+	[RELOC_PC_RELATIVE] = apply_pc_relative,
+	[RELOC_TLS] = apply_tls,
+};
+
+#undef RELOC_ARGS
+
+int do_reloc(void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab) {
+	const reloc_desc* desc = get_reloc_desc(elf_r_type(info));
+	count_reloc(desc->cls, 1);
+	return reloc_handlers[desc->cls](base, offset, info, addend, symtab, strtab, desc);
+}
+
+// batches: a run of entries of one word sized type without side effects (relative, absolute,
+// glob_dat, jump_slot not against an ifunc of the image) is applied by a loop of its own class,
+// without the descriptor lookup and the indirect call of do_reloc for each entry
+
+static inline int is_batch_class(const reloc_desc* desc, const elf_sym* symtab) {
+	if (desc->width != sizeof(size_t)) return 0;
+	if (desc->cls == RELOC_RELATIVE) return 1;
+	return symtab && (desc->cls == RELOC_ABSOLUTE || desc->cls == RELOC_GLOB_DAT || desc->cls == RELOC_JUMP_SLOT);
+}
+
+// S of a batched entry, 0 (entry ends the run) for ifunc symbols of the image
+static inline size_t batch_symbol_address(void* base, size_t info, const elf_sym* symtab, const char* strtab, int* end) {
+	const elf_sym* sym = &symtab[elf_r_sym(info)];
+	if (sym->st_value) {
+		if (elf_st_type(sym->st_info) == 10) { // STT_GNU_IFUNC
+			*end = 1;
+			return 0;
+		}
+		return (size_t) base + sym->st_value;
+	}
+	const void* sym_value = resolve_symbol(symtab, strtab, elf_r_sym(info));
+	if (!sym_value) {
+		LOGW("failed to resolve symbol `%s'.\n", strtab + sym->st_name);
+	}
+	return (size_t) sym_value;
+}
+
+static size_t rela_relative_run(void* base, const elf_rela* rela, size_t count, uint type) {
+	size_t b = (size_t) base;
+	size_t i = 0;
+	for (; i < count && elf_r_type(rela[i].r_info) == type; i++) {
+		*(size_t*) (b + rela[i].r_offset) = b + rela[i].r_addend;
+	}
+	return i;
+}
+
+// S + A, with_addend 0: S (glob_dat, jump_slot)
+static size_t rela_symbol_run(void* base, const elf_rela* rela, size_t count, uint type, const elf_sym* symtab, const char* strtab, int with_addend) {
+	size_t i = 0;
+	int end = 0;
+	for (; i < count && elf_r_type(rela[i].r_info) == type; i++) {
+		size_t value = batch_symbol_address(base, rela[i].r_info, symtab, strtab, &end);
+		if (end) break;
+		if (value) *(size_t*) ((size_t) base + rela[i].r_offset) = value + (with_addend ? rela[i].r_addend : 0);
+	}
+	return i;
+}
+
+static size_t rel_relative_run(void* base, const elf_rel* rel, size_t count, uint type) {
+	size_t b = (size_t) base;
+	size_t i = 0;
+	for (; i < count && elf_r_type(rel[i].r_info) == type; i++) {
+		*(size_t*) (b + rel[i].r_offset) += b;
+	}
+	return i;
+}
+
+// S + A (A read at P), with_addend 0: S
+static size_t rel_symbol_run(void* base, const elf_rel* rel, size_t count, uint type, const elf_sym* symtab, const char* strtab, int with_addend) {
+	size_t i = 0;
+	int end = 0;
+	for (; i < count && elf_r_type(rel[i].r_info) == type; i++) {
+		size_t value = batch_symbol_address(base, rel[i].r_info, symtab, strtab, &end);
+		if (end) break;
+		size_t* p = (size_t*) ((size_t) base + rel[i].r_offset);
+		if (value) *p = value + (with_addend ? *p : 0);
+	}
+	return i;
+}
+
+size_t do_rela_batch(void* base, const elf_rela* rela, size_t count, const elf_sym* symtab, const char* strtab) {
+	if (count == 0) return 0;
+	uint type = elf_r_type(rela->r_info);
+	const reloc_desc* desc = get_reloc_desc(type);
+	if (!is_batch_class(desc, symtab)) return 0;
+	size_t n;
+	if (desc->cls == RELOC_RELATIVE) n = rela_relative_run(base, rela, count, type);
+	else n = rela_symbol_run(base, rela, count, type, symtab, strtab, desc->cls == RELOC_ABSOLUTE);
+	if (n) {
+		LOGV("%s: 0x%lx entries from +0x%lx.\n", desc->name, n, rela->r_offset);
+		count_reloc(desc->cls, n);
+	}
+	return n;
+}
+
+size_t do_rel_batch(void* base, const elf_rel* rel, size_t count, const elf_sym* symtab, const char* strtab) {
+	if (count == 0) return 0;
+	uint type = elf_r_type(rel->r_info);
+	const reloc_desc* desc = get_reloc_desc(type);
+	if (!is_batch_class(desc, symtab)) return 0;
+	size_t n;
+	if (desc->cls == RELOC_RELATIVE) n = rel_relative_run(base, rel, count, type);
+	else n = rel_symbol_run(base, rel, count, type, symtab, strtab, desc->cls == RELOC_ABSOLUTE);
+	if (n) {
+		LOGV("%s: 0x%lx entries from +0x%lx.\n", desc->name, n, rel->r_offset);
+		count_reloc(desc->cls, n);
+	}
+	return n;
+}
+
+// lazy binding: undefined jump slots keep pointing into plt (relocated by base),
+// load_elf sets GOT[1] and GOT[2] so that plt0 jumps to lazy_bind_trampoline.
+int do_lazy_reloc(void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab) {
+	const reloc_desc* desc = get_reloc_desc(elf_r_type(info));
+	count_reloc(desc->cls, 1);
+	if (desc->cls != RELOC_JUMP_SLOT || symtab[elf_r_sym(info)].st_value) {
+		return reloc_handlers[desc->cls](base, offset, info, addend, symtab, strtab, desc);
+	}
+	LOGV("%s: lazy `%s' at +0x%lx.\n", desc->name, strtab + symtab[elf_r_sym(info)].st_name, offset);
+	*(size_t*) ((size_t) base + offset) += (size_t) base;
+	return 1;
+}
@@ -7,131 +7,723 @@
 // target remote 127.0.0.1:12345
 // #include <stdio.h>
 int getchar();
+#define _GNU_SOURCE // dladdr
 #include <dlfcn.h>
+#include <link.h> // dl_iterate_phdr
 #include <string.h>
 #include <assert.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
 #include "logger.h"
 #include "elf_struct.h"
 #include "load_elf.h"
-
-#define BADADDR ((void*) -1)
+#include "symbol_table.h"
+#include "reloc.h"
+#include "load_elf_internal.h"
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 // skip load elf with dlopen if defined
 #define SKIP_LOAD_WITH_DL
 
 #define MMAP_LOAD_BASE ((void*) 0xc0000000)
+#define HUGE_PAGE_SIZE 0x200000
 
 int (*init_array_filter)(void* base, void (*init_array_item)());
 
-extern int do_reloc(void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab) __attribute__((weak));
-
 void* load_with_mmap(const char* path);
-
-typedef struct SymbolList {
-	struct SymbolList* next;
-	const char* symbol;
-	void* addr;
-} SymbolList;
+void* load_with_mmap_fd(int fd, off_t offset, size_t size);
+void* load_with_mmap_mem(const void* buf, size_t len);
 
 typedef struct LibraryList {
 	struct LibraryList* next;
-	const char* libname;
+	char* libname; // owned
 	void* base;
+	const loaded_image* image;
 } LibraryList;
 
-static SymbolList symbol_header = { NULL, "", NULL };
+static SymbolTable registered_symbols = { NULL, 0, 0 };
 
-static LibraryList library_header = { NULL, "", NULL };
+// loader_mutex guards the lists and caches below, no code of loaded images runs while it is held
+// (lazy binding takes it from any thread). init_mutex serializes init and fini calls with their
+// prompts, and DT_NEEDED and global library loading (load_elfs), which run init and resolvers.
+// init_mutex may be taken before loader_mutex, never after
+static pthread_mutex_t loader_mutex;
+static pthread_mutex_t init_mutex;
+static pthread_once_t loader_mutex_once = PTHREAD_ONCE_INIT;
 
-void register_global_symbol(const char* symbol, void* target) {
-	LOGD("register symbol `%s' at %p.\n", symbol, target);
-	SymbolList* next = symbol_header.next;
-	SymbolList* last = &symbol_header;
-	while (next) {
-		int r = strcmp(symbol, next->symbol);
-		if (r > 0) {
-			last = next;
-			next = next->next;
-		} else if (r == 0) {
-			LOGW("registered symbol `%s' (%p) replaced with %p.\n", symbol, next->addr, target);
-			next->addr = target;
-			return;
-		} else {
-			break;
+static void init_loader_mutex() {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE); // init functions may load libraries
+	pthread_mutex_init(&loader_mutex, &attr);
+	pthread_mutex_init(&init_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void lock_loader() {
+	pthread_once(&loader_mutex_once, init_loader_mutex);
+	pthread_mutex_lock(&loader_mutex);
+}
+
+void unlock_loader() {
+	pthread_mutex_unlock(&loader_mutex);
+}
+
+void lock_init() {
+	pthread_once(&loader_mutex_once, init_loader_mutex);
+	pthread_mutex_lock(&init_mutex);
+}
+
+void unlock_init() {
+	pthread_mutex_unlock(&init_mutex);
+}
+
+static LibraryList library_header = { NULL, "", NULL, NULL };
+
+// images mapped by load_with_mmap and load_image_snapshot, for unload_elf
+typedef struct ImageList {
+	struct ImageList* next;
+	loaded_image image;
+	void* start; // reserved span, unmapped as a whole
+	size_t span;
+	size_t refcount;
+	void** deps; // DT_NEEDED libraries loaded with mmap, released with the image
+	size_t dep_count;
+	const void** ifunc_targets; // STT_GNU_IFUNC targets by symbol index, allocated on first use
+	char* path; // file loaded from, NULL for fd and memory
+	SymbolIndex* symbol_index; // built by lookup_address or get_symbol_by_name, NULL until then
+	char* dl_name; // other_images: dladdr file name when parsed, to tell another library at the same base
+} ImageList;
+
+static ImageList image_header = { NULL };
+
+// images parsed by get_loaded_image but not loaded with mmap (dlopen, the executable)
+static ImageList other_images = { NULL };
+// other_images found unloaded or replaced, never freed since other threads may still read them
+static ImageList stale_images = { NULL };
+static unsigned long long other_images_unloads = 0; // dl_unload_count when other_images were last validated
+
+// bumped by invalidate_symbol_cache (images unloaded, dlopen or dlclose outside load_elf) and when parsed images turn out stale,
+// read without lock_loader
+static size_t image_generation = 1;
+
+// get_loaded_image results of the calling thread by base, used while image_generation is unchanged
+#define IMAGE_LOOKUP_SLOTS 8
+typedef struct {
+	void* base;
+	const loaded_image* image;
+	size_t generation;
+} ImageLookup;
+static __thread ImageLookup image_lookups[IMAGE_LOOKUP_SLOTS];
+
+// DT_NEEDED libraries loaded with mmap, by needed name and DT_SONAME: NULL if unloaded, BADADDR while loading
+static SymbolTable needed_libraries = { NULL, 0, 0 };
+
+// ':' separated, searched for DT_NEEDED libraries dlopen can't load
+static char* library_search_path = NULL;
+
+// get_global_symbol results, including misses (addr NULL); symbol names are owned by the cache
+static SymbolTable symbol_cache = { NULL, 0, 0 };
+static size_t symbol_cache_hits = 0;
+static size_t symbol_cache_misses = 0;
+static size_t symbol_cache_generation = 0; // bumped by invalidate_symbol_cache
+
+void invalidate_symbol_cache() {
+	lock_loader();
+	symbol_cache_generation++;
+	__atomic_add_fetch(&image_generation, 1, __ATOMIC_RELEASE); // get_loaded_image checks its images again
+	if (symbol_cache.count) {
+		LOGV("invalidate symbol cache (%lu entries).\n", (unsigned long) symbol_cache.count);
+		for (size_t i = 0; i < symbol_cache.capacity; i++) {
+			free((void*) symbol_cache.entries[i].symbol);
 		}
+		symbol_table_clear(&symbol_cache);
 	}
-	// next == NULL || strcmp(symbol, next->symbol) < 0
-	SymbolList* s = (SymbolList*) malloc(sizeof(SymbolList));
-	s->symbol = symbol;
-	s->addr = target;
-	s->next = next;
-	last->next = s;
+	unlock_loader();
 }
 
-void* find_registered_symbol(const char* symbol) {
-	SymbolList* iter = symbol_header.next;
-	while (iter) {
-		int r = strcmp(symbol, iter->symbol);
-		if (r == 0) {
-			return iter->addr;
-		} else if (r < 0) {
-			return NULL;
-		} else {
-			iter = iter->next;
-		}
+void get_symbol_cache_stats(size_t* hits, size_t* misses) {
+	if (hits) *hits = symbol_cache_hits;
+	if (misses) *misses = symbol_cache_misses;
+}
+
+// with lock_loader held, the symbol cache is not invalidated
+static void insert_registered_symbol(const char* symbol, void* target) {
+	LOGD("register symbol `%s' at %p.\n", symbol, target);
+	int inserted;
+	SymbolEntry* e = symbol_table_insert(&registered_symbols, symbol, &inserted);
+	if (!inserted) {
+		LOGW("registered symbol `%s' (%p) replaced with %p.\n", symbol, e->addr, target);
 	}
-	return NULL;
+	e->addr = target;
 }
 
-void* get_global_symbol(const char* symbol) {
+void register_global_symbol(const char* symbol, void* target) {
+	lock_loader();
+	invalidate_symbol_cache();
+	insert_registered_symbol(symbol, target);
+	unlock_loader();
+}
+
+void register_global_symbols(const char** symbols, void** targets, size_t count) {
+	lock_loader(); // the table may be rehashed, lookups run in other threads
+	symbol_table_reserve(&registered_symbols, registered_symbols.count + count);
+	for (size_t i = 0; i < count; i++) {
+		insert_registered_symbol(symbols[i], targets[i]);
+	}
+	invalidate_symbol_cache(); // once for all of them
+	unlock_loader();
+}
+
+void* find_registered_symbol(const char* symbol) {
+	SymbolEntry* e = symbol_table_find(&registered_symbols, symbol);
+	return e ? e->addr : NULL;
+}
+
+static const elf_sym* find_image_symbol(const loaded_image* image, const char* symbol);
+static ImageList* image_node(const loaded_image* image);
+static const void* resolve_ifunc(const loaded_image* image, size_t sym);
+
+// dlsym and ifunc resolvers run unlocked, so load_elfs threads resolve in parallel
+static void* lookup_global_symbol(const char* symbol) {
+	load_stats* stats = current_load_stats();
+	lock_loader();
 	void* addr = find_registered_symbol(symbol);
+	unlock_loader();
 	if (addr) {
+		stats->symbols_registered++;
 		return addr;
 	}
 	addr = dlsym((void*) -1, symbol);
 	if (addr) {
+		stats->symbols_dlsym++;
 		return addr;
 	}
+	lock_loader();
+	const loaded_image* image = NULL;
+	const elf_sym* sym = NULL;
 	LibraryList* iter = library_header.next;
 	while (iter) {
-		addr = get_symbol_by_name(iter->base, symbol);
-		if (addr) {
-			return addr;
+		sym = find_image_symbol(iter->image, symbol);
+		if (sym) {
+			image = iter->image;
+			break;
 		}
 		iter = iter->next;
 	}
-	return NULL;
+	int is_ifunc = sym && elf_st_type(sym->st_info) == 10; // STT_GNU_IFUNC
+	if (is_ifunc) image_node(image)->refcount++; // kept loaded while its resolver runs unlocked
+	unlock_loader();
+	if (sym == NULL) {
+		stats->symbols_unresolved++;
+		return NULL;
+	}
+	stats->symbols_library++;
+	if (!is_ifunc) return (void*) ((size_t) image->base + sym->st_value);
+	addr = (void*) resolve_ifunc(image, sym - (const elf_sym*) image->symtab);
+	unload_elf(image->base);
+	return addr;
+}
+
+void* get_global_symbol(const char* symbol) {
+	lock_loader();
+	SymbolEntry* e = symbol_table_find(&symbol_cache, symbol);
+	if (e) {
+		symbol_cache_hits++;
+		current_load_stats()->symbol_cache_hits++;
+		void* addr = e->addr;
+		unlock_loader();
+		return addr;
+	}
+	symbol_cache_misses++;
+	size_t generation = symbol_cache_generation;
+	unlock_loader();
+	void* addr = lookup_global_symbol(symbol);
+	lock_loader();
+	if (generation == symbol_cache_generation) { // not invalidated while looking up
+		int inserted;
+		e = symbol_table_insert(&symbol_cache, symbol, &inserted);
+		if (inserted) e->symbol = strdup(symbol);
+		e->addr = addr;
+	}
+	unlock_loader();
+	return addr;
+}
+
+// symbol addresses resolved by symbol index while relocating one image, BADADDR if not resolved yet
+typedef struct SymbolIndexCache {
+	const void** addrs;
+	size_t count;
+	const loaded_image* image; // being relocated
+} SymbolIndexCache;
+
+static __thread SymbolIndexCache reloc_symbols = { NULL, 0, NULL };
+
+// used by do_reloc: get_global_symbol, at most once per symbol index while relocating
+// symtab of another image (lazy binding reached from a resolver or init of the one relocating): not cached
+const void* resolve_symbol(const elf_sym* symtab, const char* strtab, size_t sym) {
+	if (reloc_symbols.image == NULL || symtab != reloc_symbols.image->symtab || sym >= reloc_symbols.count) {
+		return get_global_symbol(strtab + symtab[sym].st_name);
+	}
+	if (reloc_symbols.addrs[sym] == BADADDR) {
+		reloc_symbols.addrs[sym] = get_global_symbol(strtab + symtab[sym].st_name);
+	}
+	return reloc_symbols.addrs[sym];
+}
+
+// dlopen with RTLD_GLOBAL, symbol cache is invalidated if the library was not loaded before
+static void* dlopen_global(const char* libname) {
+	void* handle = dlopen(libname, RTLD_LAZY | RTLD_NOLOAD);
+	if (handle) {
+		dlclose(handle);
+		return dlopen(libname, RTLD_NOW | RTLD_GLOBAL);
+	}
+	handle = dlopen(libname, RTLD_NOW | RTLD_GLOBAL);
+	if (handle) {
+		invalidate_symbol_cache(); // new global symbols, previous misses may resolve now
+	}
+	return handle;
+}
+
+const loaded_image* register_image(void* start, size_t span, const loaded_image* parsed, const char* path) {
+	ImageList* image = (ImageList*) malloc(sizeof(ImageList));
+	image->image = *parsed;
+	image->start = start;
+	image->span = span;
+	image->refcount = 1;
+	image->deps = NULL;
+	image->dep_count = 0;
+	image->ifunc_targets = NULL;
+	image->path = path ? strdup(path) : NULL;
+	image->symbol_index = NULL;
+	lock_loader();
+	image->next = image_header.next;
+	image_header.next = image;
+	unlock_loader();
+	return &image->image;
+}
+
+// the node before base's, so that it can be unlinked
+static ImageList* find_image_in(ImageList* list, void* base) {
+	ImageList* prev = list;
+	while (prev->next && prev->next->image.base != base) prev = prev->next;
+	return prev->next ? prev : NULL;
+}
+
+static ImageList* find_image(void* base) {
+	return find_image_in(&image_header, base);
+}
+
+// every loaded_image handed out is in an ImageList node
+static ImageList* image_node(const loaded_image* image) {
+	return (ImageList*) ((size_t) image - offsetof(ImageList, image));
+}
+
+// STT_GNU_IFUNC resolver of symbol sym, called once per image
+static const void* resolve_ifunc(const loaded_image* image, size_t sym) {
+	const elf_sym* symtab = (const elf_sym*) image->symtab;
+	if (sym >= image->symbol_count) {
+		return (const void*) call_ifunc_resolver((size_t) image->base + symtab[sym].st_value);
+	}
+	ImageList* node = image_node(image);
+	lock_loader();
+	if (node->ifunc_targets == NULL) {
+		node->ifunc_targets = (const void**) calloc(image->symbol_count, sizeof(void*));
+	}
+	const void* target = node->ifunc_targets[sym];
+	unlock_loader();
+	if (target) return target;
+	target = (const void*) call_ifunc_resolver((size_t) image->base + symtab[sym].st_value); // unlocked, it may bind lazily
+	lock_loader();
+	if (node->ifunc_targets[sym] == NULL) node->ifunc_targets[sym] = target; // first one wins if called concurrently
+	target = node->ifunc_targets[sym];
+	unlock_loader();
+	return target;
+}
+
+// used by do_reloc
+const void* resolve_ifunc_symbol(void* base, const elf_sym* symtab, size_t sym) {
+	if (reloc_symbols.image && reloc_symbols.image->base == base) {
+		return resolve_ifunc(reloc_symbols.image, sym);
+	}
+	return (const void*) call_ifunc_resolver((size_t) base + symtab[sym].st_value);
+}
+
+const loaded_image* find_loaded_image(void* base) {
+	lock_loader();
+	ImageList* prev = find_image(base);
+	const loaded_image* image = prev ? &prev->next->image : NULL;
+	unlock_loader();
+	return image;
+}
+
+static int read_unload_count(struct dl_phdr_info* info, size_t size, void* data) {
+	// dlpi_subs is missing from old libcs: ULLONG_MAX validates on every lookup
+	*(unsigned long long*) data = size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs) ? info->dlpi_subs : ULLONG_MAX;
+	return 1; // the first object is enough
+}
+
+// number of objects dlclose has unloaded so far
+static unsigned long long dl_unload_count() {
+	unsigned long long unloads = ULLONG_MAX;
+	dl_iterate_phdr(read_unload_count, &unloads);
+	return unloads;
+}
+
+// dladdr file name of the object loaded at base, NULL if none starts there
+static const char* get_dl_name(void* base) {
+	Dl_info info;
+	if (dladdr(base, &info) == 0 || info.dli_fbase != base) return NULL;
+	return info.dli_fname ? info.dli_fname : "";
+}
+
+// with lock_loader held: move other_images no longer loaded at their base (dlclose, maybe another library since) to stale_images
+static void validate_other_images(unsigned long long unloads) {
+	if (unloads == other_images_unloads && unloads != ULLONG_MAX) return;
+	other_images_unloads = unloads;
+	for (ImageList* prev = &other_images; prev->next; ) {
+		ImageList* image = prev->next;
+		const char* name = get_dl_name(image->image.base);
+		if (name == NULL ? image->dl_name == NULL : image->dl_name && strcmp(name, image->dl_name) == 0) { // unnamed ones can't be told apart
+			prev = image;
+			continue;
+		}
+		LOGD("drop stale parsed image %p.\n", image->image.base);
+		prev->next = image->next;
+		image->next = stale_images.next;
+		stale_images.next = image;
+		__atomic_add_fetch(&image_generation, 1, __ATOMIC_RELEASE);
+	}
 }
 
-void load_needed_library(const char* libname) {
+const loaded_image* get_loaded_image(void* base) {
+	ImageLookup* lookup = &image_lookups[((size_t) base >> 12) % IMAGE_LOOKUP_SLOTS];
+	if (lookup->base == base && lookup->generation == __atomic_load_n(&image_generation, __ATOMIC_ACQUIRE)) {
+		return lookup->image;
+	}
+	lock_loader();
+	ImageList* prev = find_image(base);
+	if (prev == NULL) {
+		validate_other_images(dl_unload_count());
+		prev = find_image_in(&other_images, base);
+	}
+	ImageList* image = prev ? prev->next : NULL;
+	if (image == NULL) {
+		const char* name = get_dl_name(base);
+		image = (ImageList*) calloc(1, sizeof(ImageList));
+		const elf_header* header = (const elf_header*) base;
+		if (!parse_image(&image->image, base, get_dyn(base), (const elf_program_header*) ((size_t) base + header->e_phoff), header->e_phnum)) {
+			unlock_loader();
+			free(image);
+			return NULL;
+		}
+		image->dl_name = name ? strdup(name) : NULL;
+		image->next = other_images.next;
+		other_images.next = image;
+	}
+	lookup->base = base;
+	lookup->image = &image->image;
+	lookup->generation = image_generation;
+	unlock_loader();
+	return &image->image;
+}
+
+void retain_image(void* base) {
+	lock_loader();
+	ImageList* prev = find_image(base);
+	if (prev) prev->next->refcount++;
+	unlock_loader();
+}
+
+// with lock_loader held: unlink the image after prev, so that it is no longer found, retained or used for DT_NEEDED
+static ImageList* unlink_image(ImageList* prev) {
+	ImageList* image = prev->next;
+	void* base = image->image.base;
+	prev->next = image->next;
+	for (LibraryList* iter = &library_header; iter->next; ) {
+		LibraryList* lib = iter->next;
+		if (lib->base == base) {
+			iter->next = lib->next;
+			free(lib->libname);
+			free(lib);
+		} else {
+			iter = lib;
+		}
+	}
+	for (size_t i = 0; i < needed_libraries.capacity; i++) {
+		if (needed_libraries.entries[i].symbol && needed_libraries.entries[i].addr == base) {
+			needed_libraries.entries[i].addr = NULL;
+		}
+	}
+	invalidate_symbol_cache(); // addresses in the image may be cached, so may the image
+	return image;
+}
+
+// without lock_loader: fini (if finalize) and munmap run code and take the locks
+static void release_image(ImageList* image, int finalize) {
+	if (finalize && image->image.dyn) {
+		run_fini(&image->image);
+		const size_t* got = image->image.pltgot;
+		if (got && got[2] == (size_t) lazy_bind_trampoline) {
+			free((void*) got[1]); // LazyBinding
+		}
+	}
+	if (finalize) munmap(image->start, image->span);
+	// dependencies are finalized after the image using them
+	for (size_t i = image->dep_count; i > 0; i--) {
+		unload_elf(image->deps[i - 1]);
+	}
+	free(image->deps);
+	free(image->ifunc_targets);
+	free(image->path);
+	free_symbol_index(image->symbol_index);
+	free(image);
+}
+
+void discard_image(void* base) {
+	lock_loader();
+	ImageList* prev = find_image(base);
+	ImageList* image = prev ? unlink_image(prev) : NULL;
+	unlock_loader();
+	if (image) release_image(image, 0);
+}
+
+int unload_elf(void* base) {
+	lock_loader();
+	ImageList* prev = find_image(base);
+	if (prev == NULL) {
+		unlock_loader();
+		LOGW("%p was not loaded by load_with_mmap, can't unload.\n", base);
+		return 0;
+	}
+	ImageList* image = prev->next;
+	if (--image->refcount) {
+		LOGD("%p still referenced (%lu).\n", base, image->refcount);
+		unlock_loader();
+		return 1;
+	}
+	unlink_image(prev);
+	unlock_loader();
+	LOGI("unloading %p...\n", base);
+	release_image(image, 1);
+	LOGI("unloaded %p.\n", base);
+	return 1;
+}
+
+void set_library_search_path(const char* path) {
+	lock_loader();
+	free(library_search_path);
+	library_search_path = path ? strdup(path) : NULL;
+	unlock_loader();
+}
+
+static int append_path(char* path, size_t* len, const char* s, size_t n) {
+	if (*len + n >= PATH_MAX) return 0;
+	memcpy(path + *len, s, n);
+	*len += n;
+	path[*len] = 0;
+	return 1;
+}
+
+// first libname in the ':' separated dirs that loads with mmap, $ORIGIN is replaced by origin
+static void* load_from_dirs(const char* dirs, const char* libname, const char* origin) {
+	if (dirs == NULL) return BADADDR;
+	char path[PATH_MAX];
+	for (const char* dir = dirs; *dir; ) {
+		const char* end = strchr(dir, ':');
+		if (end == NULL) end = dir + strlen(dir);
+		size_t len = 0;
+		int ok = 1;
+		path[0] = 0;
+		for (const char* it = dir; ok && it < end; ) {
+			size_t skip = strncmp(it, "$ORIGIN", 7) == 0 ? 7 : strncmp(it, "${ORIGIN}", 9) == 0 ? 9 : 0;
+			if (skip) {
+				ok = origin && append_path(path, &len, origin, strlen(origin)); // no origin for fd or memory images
+				it += skip;
+			} else {
+				ok = append_path(path, &len, it++, 1);
+			}
+		}
+		if (ok && len && append_path(path, &len, "/", 1) && append_path(path, &len, libname, strlen(libname)) && access(path, R_OK) == 0) {
+			void* base = load_with_mmap(path);
+			if (base != BADADDR) return base;
+		}
+		dir = *end ? end + 1 : end;
+	}
+	return BADADDR;
+}
+
+static void set_needed_library(const char* libname, void* base) {
+	int inserted;
+	SymbolEntry* e = symbol_table_insert(&needed_libraries, libname, &inserted);
+	if (inserted) e->symbol = strdup(libname);
+	e->addr = base;
+}
+
+void publish_library(const char* libname, void* base) {
+	lock_loader();
+	set_needed_library(libname, base);
+	const loaded_image* image = find_loaded_image(base);
+	if (image && image->soname) {
+		set_needed_library(image->soname, base);
+	}
+	invalidate_symbol_cache();
+	LibraryList* lib = (LibraryList*) malloc(sizeof(LibraryList));
+	lib->next = library_header.next;
+	library_header.next = lib;
+	lib->libname = strdup(libname);
+	lib->base = base;
+	lib->image = image;
+	unlock_loader();
+}
+
+static int is_global_library(void* base) {
+	for (LibraryList* iter = library_header.next; iter; iter = iter->next) {
+		if (iter->base == base) return 1;
+	}
+	return 0;
+}
+
+// an image loaded with mmap (load_elf...) serves later DT_NEEDED of its file name or DT_SONAME,
+// unless another library of that name is loaded or being loaded
+void record_loaded_library(const loaded_image* image, const char* path) {
+	const char* names[2] = { NULL, image->soname };
+	if (path) names[0] = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	lock_loader();
+	for (int i = 0; i < 2; i++) {
+		if (names[i] == NULL || names[i][0] == 0) continue;
+		SymbolEntry* e = symbol_table_find(&needed_libraries, names[i]);
+		if (e && e->addr) continue;
+		LOGD("`%s' recorded at %p for DT_NEEDED.\n", names[i], image->base);
+		set_needed_library(names[i], image->base);
+	}
+	unlock_loader();
+}
+
+// dlopen libname, or load_with_mmap it from DT_RPATH, the search path and DT_RUNPATH of the image needing it.
+// returns the base if loaded with mmap, retained for the image, otherwise NULL. called with lock_init held
+void* load_needed_library(const char* libname, const loaded_image* image, const char* origin) {
 	LOGD("loading needed library `%s'.\n", libname);
-	void* handle = dlopen(libname, RTLD_NOW | RTLD_GLOBAL);
-	if (handle == NULL) {
-		LOGW("failed to load needed library `%s': %s.\n", libname, dlerror());
+	lock_loader();
+	SymbolEntry* e = symbol_table_find(&needed_libraries, libname);
+	if (e && e->addr == BADADDR) {
+		unlock_loader();
+		LOGW("circular dependency on `%s', skipped.\n", libname);
+		return NULL;
+	}
+	if (e && e->addr) {
+		void* base = e->addr;
+		LOGD("`%s' already loaded at %p.\n", libname, base);
+		retain_image(base);
+		if (!is_global_library(base)) publish_library(libname, base); // loaded by load_elf, its symbols become global
+		unlock_loader();
+		return base;
+	}
+	unlock_loader();
+	void* handle = dlopen_global(libname); // runs its constructors
+	if (handle) {
+		return NULL;
+	}
+	LOGD("dlopen failed to load needed library `%s': %s.\n", libname, dlerror());
+
+	lock_loader();
+	e = symbol_table_find(&needed_libraries, libname);
+	if (e == NULL) e = symbol_table_insert(&needed_libraries, strdup(libname), NULL);
+	e->addr = BADADDR;
+	char* search_path = library_search_path ? strdup(library_search_path) : NULL;
+	unlock_loader();
+	const char* rpath = image->runpath ? NULL : image->rpath; // DT_RPATH, ignored if DT_RUNPATH exists
+	const char* runpath = image->runpath;
+	void* base;
+	if (strchr(libname, '/')) {
+		base = load_with_mmap(libname);
+	} else {
+		base = load_from_dirs(rpath, libname, origin);
+		if (base == BADADDR) base = load_from_dirs(search_path, libname, origin);
+		if (base == BADADDR) base = load_from_dirs(runpath, libname, origin);
+	}
+	free(search_path);
+	if (base == BADADDR) {
+		LOGW("failed to load needed library `%s'.\n", libname);
+		lock_loader();
+		symbol_table_find(&needed_libraries, libname)->addr = NULL; // may be moved by nested loads
+		unlock_loader();
+		return NULL;
 	}
+	publish_library(libname, base);
+	return base;
+}
+
+void load_needed_libraries(const loaded_image* image, const char* path) {
+	char origin[PATH_MAX];
+	const char* slash = path ? strrchr(path, '/') : NULL;
+	if (slash == NULL) {
+		strcpy(origin, ".");
+	} else {
+		size_t len = slash == path ? 1 : slash - path;
+		memcpy(origin, path, len);
+		origin[len] = 0;
+	}
+	lock_init(); // each library is loaded once, by one thread
+	lock_loader();
+	ImageList* prev = find_image(image->base);
+	ImageList* node = prev ? prev->next : NULL; // nodes stay, prev may change while loading
+	unlock_loader();
+	for (const elf_dyn* it = (const elf_dyn*) image->dyn; it->d_tag != 0; it++) {
+		if (it->d_tag != 1) continue; // DT_NEEDED: name of needed library
+		void* lib = load_needed_library(image->strtab + it->d_un, image, path ? origin : NULL);
+		if (lib && node) {
+			lock_loader();
+			node->deps = (void**) realloc(node->deps, (node->dep_count + 1) * sizeof(void*));
+			node->deps[node->dep_count++] = lib;
+			unlock_loader();
+		}
+	}
+	unlock_init();
 }
 
 void load_global_library(const char* libname) {
 	LOGD("loading global library `%s'.\n", libname);
-	void* handle = dlopen(libname, RTLD_NOW | RTLD_GLOBAL);
+	lock_init(); // loaded once, by one thread
+	lock_loader();
+	for (LibraryList* iter = library_header.next; iter; iter = iter->next) {
+		if (strcmp(iter->libname, libname) == 0) {
+			LOGD("`%s' already loaded at %p.\n", libname, iter->base);
+			retain_image(iter->base);
+			unlock_loader();
+			unlock_init();
+			return;
+		}
+	}
+	unlock_loader();
+	void* handle = dlopen_global(libname);
 	if (handle) {
+		unlock_init();
 		return;
 	}
 	LOGW("dlopen failed to load global library `%s': %s.\n", libname, dlerror());
 
 	void* base = load_with_mmap(libname);
-	if (base) {
+	if (base != BADADDR) {
+		lock_loader();
+		invalidate_symbol_cache();
 		LibraryList* lib = (LibraryList*) malloc(sizeof(LibraryList));
 		lib->next = library_header.next;
 		library_header.next = lib;
-		lib->libname = libname;
+		lib->libname = strdup(libname);
 		lib->base = base;
+		lib->image = find_loaded_image(base);
+		unlock_loader();
 	}
+	unlock_init();
 }
 
 void* load_with_dl(const char* path) {
@@ -172,216 +764,957 @@ int check_header(elf_header* header) {
 		LOGE("Unexpected header size.\n");
 		return 0;
 	}
-	return 1;
+	return 1;
+}
+
+const elf_dyn* find_dyn_entry(const elf_dyn* dyn, int type) {
+	for (; dyn->d_tag != 0; dyn++) { // DT_NULL
+		if (dyn->d_tag == type) return dyn;
+	}
+	return NULL;
+}
+
+// tables are split across up to reloc_threads threads, each with at least PARALLEL_RELOC_MIN entries:
+// starting and joining a thread costs more than relocating a smaller chunk
+#define PARALLEL_RELOC_MIN 0x4000
+
+static int reloc_threads = 1;
+
+void set_reloc_threads(int threads) {
+	reloc_threads = threads > 0 ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+static int reloc_thread_count(size_t count) {
+	size_t threads = count / PARALLEL_RELOC_MIN;
+	return threads < (size_t) reloc_threads ? (int) threads : reloc_threads;
+}
+
+static int use_reloc_threads(size_t count) {
+	return reloc_thread_count(count) > 1;
+}
+
+// [begin, end) of a relocation table, applied by one thread
+typedef struct RelocChunk {
+	void (*fn)(struct RelocChunk* chunk);
+	void* base;
+	const void* table; // elf_rel, elf_rela or DT_RELR entries
+	size_t begin;
+	size_t end;
+	size_t count;
+	const elf_sym* symtab;
+	const char* strtab;
+	SymbolIndexCache symbols; // filled before the threads start, only read by them
+	int ok;
+	load_stats stats; // of the worker thread, added to the loading thread's
+} RelocChunk;
+
+static void* reloc_worker(void* arg) {
+	RelocChunk* chunk = (RelocChunk*) arg;
+	reloc_symbols = chunk->symbols;
+	chunk->fn(chunk);
+	chunk->stats = *current_load_stats();
+	return NULL;
+}
+
+static void init_reloc_chunk(RelocChunk* chunk, void (*fn)(RelocChunk*), void* base, const void* table, size_t begin, size_t end, size_t count, const elf_sym* symtab, const char* strtab) {
+	chunk->fn = fn;
+	chunk->base = base;
+	chunk->table = table;
+	chunk->begin = begin;
+	chunk->end = end;
+	chunk->count = count;
+	chunk->symtab = symtab;
+	chunk->strtab = strtab;
+	chunk->symbols = reloc_symbols;
+	chunk->ok = 1;
+}
+
+static int run_reloc_chunks(void (*fn)(RelocChunk*), void* base, const void* table, size_t count, const elf_sym* symtab, const char* strtab) {
+	int threads = reloc_thread_count(count);
+	RelocChunk* chunks = (RelocChunk*) malloc(threads * sizeof(RelocChunk));
+	pthread_t* workers = (pthread_t*) malloc(threads * sizeof(pthread_t));
+	int* started = (int*) calloc(threads, sizeof(int));
+	if (chunks == NULL || workers == NULL || started == NULL) {
+		LOGW("out of memory for relocation threads, relocating 0x%lx entries on this one.\n", (unsigned long) count);
+		free(started);
+		free(workers);
+		free(chunks);
+		RelocChunk chunk;
+		init_reloc_chunk(&chunk, fn, base, table, 0, count, count, symtab, strtab);
+		fn(&chunk);
+		return chunk.ok;
+	}
+	LOGD("0x%lx relocations on %d threads.\n", (unsigned long) count, threads);
+	for (int i = 0; i < threads; i++) {
+		init_reloc_chunk(&chunks[i], fn, base, table, count * i / threads, count * (i + 1) / threads, count, symtab, strtab);
+	}
+	for (int i = 1; i < threads; i++) { // the caller takes the first chunk
+		started[i] = pthread_create(&workers[i], NULL, reloc_worker, &chunks[i]) == 0;
+	}
+	fn(&chunks[0]);
+	int ok = chunks[0].ok;
+	for (int i = 1; i < threads; i++) {
+		if (started[i]) {
+			pthread_join(workers[i], NULL);
+			for (int cls = 0; cls < LOAD_STATS_RELOC_CLASSES; cls++) count_reloc(cls, chunks[i].stats.relocs[cls]);
+		} else {
+			fn(&chunks[i]);
+		}
+		ok &= chunks[i].ok;
+	}
+	free(started);
+	free(workers);
+	free(chunks);
+	return ok;
+}
+
+// R_IRELATIVE and relocations against ifunc symbols of the image call its resolvers
+static int is_ifunc_reloc(size_t info, const elf_sym* symtab) {
+	if (find_reloc_desc(info)->cls == RELOC_IRELATIVE) return 1;
+	const elf_sym* sym = symtab ? &symtab[elf_r_sym(info)] : NULL;
+	return sym && sym->st_value && elf_st_type(sym->st_info) == 10; // STT_GNU_IFUNC
+}
+
+// an ifunc relocation of the image being relocated, applied after all tables
+typedef struct DeferredReloc {
+	size_t offset;
+	size_t info;
+	size_t addend; // implicit addend read from the image for rel
+} DeferredReloc;
+
+typedef struct DeferredRelocs {
+	DeferredReloc* entries;
+	size_t count;
+	size_t capacity;
+} DeferredRelocs;
+
+// set by do_dynamic_relocs: resolvers may call functions bound by any table, so they run after all of them (as ld.so runs R_IRELATIVE last)
+static __thread DeferredRelocs* deferred_relocs = NULL;
+
+static int defer_reloc(size_t offset, size_t info, size_t addend) {
+	DeferredRelocs* list = deferred_relocs;
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 16;
+		DeferredReloc* entries = (DeferredReloc*) realloc(list->entries, capacity * sizeof(DeferredReloc));
+		if (entries == NULL) {
+			LOGE("out of memory deferring ifunc relocations.\n");
+			return 0;
+		}
+		list->entries = entries;
+		list->capacity = capacity;
+	}
+	DeferredReloc* entry = &list->entries[list->count++];
+	entry->offset = offset;
+	entry->info = info;
+	entry->addend = addend;
+	return 1;
+}
+
+// do_reloc, unless it is deferred
+static int apply_reloc(void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab) {
+	if (deferred_relocs && is_ifunc_reloc(info, symtab)) return defer_reloc(offset, info, addend);
+	return do_reloc(base, offset, info, addend, symtab, strtab);
+}
+
+// apply_reloc as a reloc_visitor, for android packed tables
+static int visit_apply_reloc(void* arg, void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab) {
+	return apply_reloc(base, offset, info, addend, symtab, strtab);
+}
+
+// R_COPY reads memory other relocations may write, ifunc resolvers call code in the image
+static int is_serial_reloc(size_t info, const elf_sym* symtab) {
+	return find_reloc_desc(info)->cls == RELOC_COPY || is_ifunc_reloc(info, symtab);
+}
+
+// resolve the symbols of the table once, so the threads don't take the loader lock
+static void resolve_reloc_symbols(size_t info, const elf_sym* symtab, const char* strtab) {
+	size_t sym = elf_r_sym(info);
+	if (symtab == NULL || sym == 0 || symtab[sym].st_value) return;
+	switch (find_reloc_desc(info)->cls) {
+	case RELOC_ABSOLUTE:
+	case RELOC_GLOB_DAT:
+	case RELOC_JUMP_SLOT:
+	case RELOC_PC_RELATIVE:
+		resolve_symbol(symtab, strtab, sym);
+		break;
+	default:
+		break;
+	}
+}
+
+static void rel_chunk(RelocChunk* chunk) {
+	const elf_rel* rel = (const elf_rel*) chunk->table;
+	for (size_t i = chunk->begin; i < chunk->end; i++) {
+		size_t n = do_rel_batch(chunk->base, rel + i, chunk->end - i, chunk->symtab, chunk->strtab);
+		if (n) {
+			i += n - 1;
+			continue;
+		}
+		if (is_serial_reloc(rel[i].r_info, chunk->symtab)) continue;
+		if (!do_reloc(chunk->base, rel[i].r_offset, rel[i].r_info, *(size_t*) ((size_t) chunk->base + rel[i].r_offset), chunk->symtab, chunk->strtab))
+			chunk->ok = 0;
+	}
+}
+
+static void rela_chunk(RelocChunk* chunk) {
+	const elf_rela* rela = (const elf_rela*) chunk->table;
+	for (size_t i = chunk->begin; i < chunk->end; i++) {
+		size_t n = do_rela_batch(chunk->base, rela + i, chunk->end - i, chunk->symtab, chunk->strtab);
+		if (n) {
+			i += n - 1;
+			continue;
+		}
+		if (is_serial_reloc(rela[i].r_info, chunk->symtab)) continue;
+		if (!do_reloc(chunk->base, rela[i].r_offset, rela[i].r_info, rela[i].r_addend, chunk->symtab, chunk->strtab))
+			chunk->ok = 0;
+	}
+}
+
+// symbols resolved first, then the table in parallel, then R_COPY and R_IRELATIVE in order
+static int do_rel_parallel(void* base, const elf_rel* rel, int count, const elf_sym* symtab, const char* strtab) {
+	for (int i = 0; i < count; i++) resolve_reloc_symbols(rel[i].r_info, symtab, strtab);
+	int ok = run_reloc_chunks(rel_chunk, base, rel, count, symtab, strtab);
+	for (int i = 0; i < count && ok; i++) {
+		if (is_serial_reloc(rel[i].r_info, symtab))
+			ok = apply_reloc(base, rel[i].r_offset, rel[i].r_info, *(size_t*) ((size_t) base + rel[i].r_offset), symtab, strtab);
+	}
+	return ok;
+}
+
+static int do_rela_parallel(void* base, const elf_rela* rela, int count, const elf_sym* symtab, const char* strtab) {
+	for (int i = 0; i < count; i++) resolve_reloc_symbols(rela[i].r_info, symtab, strtab);
+	int ok = run_reloc_chunks(rela_chunk, base, rela, count, symtab, strtab);
+	for (int i = 0; i < count && ok; i++) {
+		if (is_serial_reloc(rela[i].r_info, symtab))
+			ok = apply_reloc(base, rela[i].r_offset, rela[i].r_info, rela[i].r_addend, symtab, strtab);
+	}
+	return ok;
+}
+
+int do_rel(void* base, const elf_rel* rel, int count, const elf_sym* symtab, const char* strtab) {
+	if (use_reloc_threads(count)) return do_rel_parallel(base, rel, count, symtab, strtab);
+	for (int i = 0; i < count; i++) {
+		size_t n = do_rel_batch(base, rel + i, count - i, symtab, strtab);
+		if (n) {
+			i += n - 1;
+			continue;
+		}
+		if (!apply_reloc(base, rel[i].r_offset, rel[i].r_info, *(size_t*) ((size_t) base + rel[i].r_offset), symtab, strtab))
+			return 0;
+	}
+	return 1;
+}
+
+int do_rela(void* base, const elf_rela* rela, int count, const elf_sym* symtab, const char* strtab) {
+	if (use_reloc_threads(count)) return do_rela_parallel(base, rela, count, symtab, strtab);
+	for (int i = 0; i < count; i++) {
+		size_t n = do_rela_batch(base, rela + i, count - i, symtab, strtab);
+		if (n) {
+			i += n - 1;
+			continue;
+		}
+		if (!apply_reloc(base, rela[i].r_offset, rela[i].r_info, rela[i].r_addend, symtab, strtab))
+			return 0;
+	}
+	return 1;
+}
+
+static void relative_rel_chunk(RelocChunk* chunk) {
+	const elf_rel* rel = (const elf_rel*) chunk->table;
+	size_t b = (size_t) chunk->base;
+	for (size_t i = chunk->begin; i < chunk->end; i++) {
+		*(size_t*) (b + rel[i].r_offset) += b;
+	}
+	count_reloc(RELOC_RELATIVE, chunk->end - chunk->begin);
+}
+
+static void relative_rela_chunk(RelocChunk* chunk) {
+	const elf_rela* rela = (const elf_rela*) chunk->table;
+	size_t b = (size_t) chunk->base;
+	for (size_t i = chunk->begin; i < chunk->end; i++) {
+		*(size_t*) (b + rela[i].r_offset) = b + rela[i].r_addend;
+	}
+	count_reloc(RELOC_RELATIVE, chunk->end - chunk->begin);
+}
+
+// the first DT_RELCOUNT / DT_RELACOUNT entries are all R_RELATIVE, no need to do_reloc them
+void do_relative_rel(void* base, const elf_rel* rel, int count) {
+	RelocChunk chunk = { NULL, base, rel, 0, count };
+	if (use_reloc_threads(count)) run_reloc_chunks(relative_rel_chunk, base, rel, count, NULL, NULL);
+	else relative_rel_chunk(&chunk);
+}
+
+void do_relative_rela(void* base, const elf_rela* rela, int count) {
+	RelocChunk chunk = { NULL, base, rela, 0, count };
+	if (use_reloc_threads(count)) run_reloc_chunks(relative_rela_chunk, base, rela, count, NULL, NULL);
+	else relative_rela_chunk(&chunk);
+}
+
+// DT_RELR: an even entry is the offset of a relative relocation,
+// an odd entry is a bitmap of the following (bits - 1) words.
+// A chunk starts at its first even entry and ends before the first even entry of the next one.
+static void relr_chunk(RelocChunk* chunk) {
+	void* base = chunk->base;
+	const size_t* relr = (const size_t*) chunk->table;
+	size_t begin = chunk->begin;
+	size_t end = chunk->end;
+	while (begin < end && (relr[begin] & 1)) begin++;
+	while (end < chunk->count && (relr[end] & 1)) end++;
+	size_t* where = NULL;
+	size_t count = 0;
+	for (size_t i = begin; i < end; i++) {
+		size_t entry = relr[i];
+		if ((entry & 1) == 0) {
+			where = (size_t*) ((size_t) base + entry);
+			*where++ += (size_t) base;
+			count++;
+		} else {
+			for (size_t bits = entry >> 1, j = 0; bits; bits >>= 1, j++) {
+				if (bits & 1) {
+					where[j] += (size_t) base;
+					count++;
+				}
+			}
+			where += sizeof(size_t) * 8 - 1;
+		}
+	}
+	count_reloc(RELOC_RELATIVE, count);
+}
+
+int do_relr(void* base, const size_t* relr, size_t count) {
+	RelocChunk chunk = { NULL, base, relr, 0, count, count };
+	if (use_reloc_threads(count)) return run_reloc_chunks(relr_chunk, base, relr, count, NULL, NULL);
+	relr_chunk(&chunk);
+	return 1;
+}
+
+static size_t decode_sleb128(const uchar** p, const uchar* end) {
+	size_t value = 0;
+	uint shift = 0;
+	uchar byte;
+	do {
+		if (*p == NULL || *p >= end) {
+			*p = NULL; // out of data
+			return 0;
+		}
+		if (shift >= sizeof(size_t) * 8) {
+			*p = NULL; // more bytes than a size_t holds, malformed
+			return 0;
+		}
+		byte = *(*p)++;
+		value |= (size_t) (byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	if (shift < sizeof(size_t) * 8 && (byte & 0x40)) {
+		value |= (size_t) -1 << shift;
+	}
+	return value;
+}
+
+// DT_ANDROID_REL / DT_ANDROID_RELA: "APS2", then sleb128 relocation count, initial offset and groups of
+// group_size, group_flags, [offset delta], [info], [addend delta], followed by the fields not shared in group.
+// Relocations are passed to fn (apply_reloc) as soon as decoded.
+int do_android_packed(void* base, const uchar* packed, size_t size, int is_rela, const elf_sym* symtab, const char* strtab, reloc_visitor fn, void* arg) {
+	#define GROUPED_BY_INFO 1
+	#define GROUPED_BY_OFFSET_DELTA 2
+	#define GROUPED_BY_ADDEND 4
+	#define GROUP_HAS_ADDEND 8
+	const uchar* end = packed + size;
+	if (size < 4 || memcmp(packed, "APS2", 4) != 0) {
+		LOGE("android packed relocations: bad magic.\n");
+		return 0;
+	}
+	const uchar* p = packed + 4;
+	size_t count = decode_sleb128(&p, end);
+	size_t offset = decode_sleb128(&p, end);
+	size_t info = 0;
+	size_t addend = 0;
+	if (p == NULL) goto out_of_data;
+	LOGD("%lu android packed relocations.\n", (unsigned long) count);
+	for (size_t done = 0; done < count; ) {
+		size_t group_size = decode_sleb128(&p, end);
+		size_t group_flags = decode_sleb128(&p, end);
+		size_t group_offset_delta = 0;
+		if (p == NULL) goto out_of_data;
+		if (group_size == 0 || group_size > count - done) {
+			LOGE("android packed relocations: bad group size %lu.\n", (unsigned long) group_size);
+			return 0;
+		}
+		if (group_flags & GROUPED_BY_OFFSET_DELTA) group_offset_delta = decode_sleb128(&p, end);
+		if (group_flags & GROUPED_BY_INFO) info = decode_sleb128(&p, end);
+		if (group_flags & GROUP_HAS_ADDEND) {
+			if (!is_rela) {
+				LOGE("android packed relocations: unexpected addend in rel.\n");
+				return 0;
+			}
+			if (group_flags & GROUPED_BY_ADDEND) addend += decode_sleb128(&p, end);
+		} else {
+			addend = 0;
+		}
+		for (size_t i = 0; i < group_size; i++) {
+			offset += (group_flags & GROUPED_BY_OFFSET_DELTA) ? group_offset_delta : decode_sleb128(&p, end);
+			if (!(group_flags & GROUPED_BY_INFO)) info = decode_sleb128(&p, end);
+			if ((group_flags & GROUP_HAS_ADDEND) && !(group_flags & GROUPED_BY_ADDEND)) addend += decode_sleb128(&p, end);
+			if (p == NULL) goto out_of_data;
+			if (!fn(arg, base, offset, info, is_rela ? addend : *(size_t*) ((size_t) base + offset), symtab, strtab))
+				return 0;
+		}
+		done += group_size;
+	}
+	return 1;
+
+out_of_data:
+	LOGE("android packed relocations: unexpected end of data or malformed sleb128.\n");
+	return 0;
+	#undef GROUPED_BY_INFO
+	#undef GROUPED_BY_OFFSET_DELTA
+	#undef GROUPED_BY_ADDEND
+	#undef GROUP_HAS_ADDEND
+}
+
+static int lazy_binding = 0;
+
+void set_lazy_binding(int enable) {
+	lazy_binding = enable;
+}
+
+// GOT[1] of a lazily bound image, passed to lazy_bind_fixup by lazy_bind_trampoline
+typedef struct LazyBinding {
+	void* base;
+	const void* jmprel;
+	int is_rela;
+	size_t count;
+	const elf_sym* symtab;
+	const char* strtab;
+} LazyBinding;
+
+// called by lazy_bind_trampoline on the first call through a plt entry, returns the target
+size_t lazy_bind_fixup(LazyBinding* lazy, size_t index) {
+	if (index >= lazy->count) {
+		LOGE("lazy binding: bad jmprel index %lu of image %p.\n", (unsigned long) index, lazy->base);
+		abort();
+	}
+	size_t offset, info, addend;
+	if (lazy->is_rela) {
+		const elf_rela* rela = (const elf_rela*) lazy->jmprel + index;
+		offset = rela->r_offset;
+		info = rela->r_info;
+		addend = rela->r_addend;
+	} else {
+		const elf_rel* rel = (const elf_rel*) lazy->jmprel + index;
+		offset = rel->r_offset;
+		info = rel->r_info;
+		addend = 0;
+	}
+	size_t* slot = (size_t*) ((size_t) lazy->base + offset);
+	size_t plt = *slot;
+	LOGV("lazy binding `%s' at %p.\n", lazy->strtab + lazy->symtab[elf_r_sym(info)].st_name, slot);
+	do_reloc(lazy->base, offset, info, addend, lazy->symtab, lazy->strtab);
+	if (*slot == plt) {
+		LOGE("lazy binding: failed to resolve symbol `%s'.\n", lazy->strtab + lazy->symtab[elf_r_sym(info)].st_name);
+		abort();
+	}
+	return *slot;
+}
+
+static int can_bind_lazily(const loaded_image* image) {
+	return lazy_binding && image->pltgot && !image->bind_now;
+}
+
+int do_jmprel(const loaded_image* image) {
+	void* base = image->base;
+	const void* jmprel = image->jmprel;
+	int count = image->jmprel_count;
+	int is_rela = image->jmprel_is_rela;
+	const elf_sym* symtab = (const elf_sym*) image->symtab;
+	const char* strtab = image->strtab;
+	if (!can_bind_lazily(image)) {
+		if (is_rela) return do_rela(base, (const elf_rela*) jmprel, count, symtab, strtab);
+		return do_rel(base, (const elf_rel*) jmprel, count, symtab, strtab);
+	}
+	LOGD("lazy binding.\n");
+	for (int i = 0; i < count; i++) {
+		int ok;
+		if (is_rela) {
+			const elf_rela* rela = (const elf_rela*) jmprel + i;
+			if (is_ifunc_reloc(rela->r_info, symtab)) ok = apply_reloc(base, rela->r_offset, rela->r_info, rela->r_addend, symtab, strtab);
+			else ok = do_lazy_reloc(base, rela->r_offset, rela->r_info, rela->r_addend, symtab, strtab);
+		} else {
+			const elf_rel* rel = (const elf_rel*) jmprel + i;
+			size_t addend = *(size_t*) ((size_t) base + rel->r_offset);
+			if (is_ifunc_reloc(rel->r_info, symtab)) ok = apply_reloc(base, rel->r_offset, rel->r_info, addend, symtab, strtab);
+			else ok = do_lazy_reloc(base, rel->r_offset, rel->r_info, addend, symtab, strtab);
+		}
+		if (!ok) return 0;
+	}
+	LazyBinding* lazy = (LazyBinding*) malloc(sizeof(LazyBinding));
+	lazy->base = base;
+	lazy->jmprel = jmprel;
+	lazy->is_rela = is_rela;
+	lazy->count = count;
+	lazy->symtab = symtab;
+	lazy->strtab = strtab;
+	size_t* got = image->pltgot;
+	got[1] = (size_t) lazy;
+	got[2] = (size_t) lazy_bind_trampoline;
+	return 1;
+}
+
+static int do_reloc_tables(const loaded_image* image) {
+	void* base = image->base;
+	const elf_sym* symtab = (const elf_sym*) image->symtab;
+	const char* strtab = image->strtab;
+	if (image->relr) {
+		LOGD("do relr.\n");
+		if (!do_relr(base, image->relr, image->relr_count)) return 0;
+	}
+	if (image->android_rela) {
+		LOGD("do android rela.\n");
+		if (!do_android_packed(base, image->android_rela, image->android_rela_size, 1, symtab, strtab, visit_apply_reloc, NULL)) return 0;
+	}
+	if (image->android_rel) {
+		LOGD("do android rel.\n");
+		if (!do_android_packed(base, image->android_rel, image->android_rel_size, 0, symtab, strtab, visit_apply_reloc, NULL)) return 0;
+	}
+	if (image->rela) {
+		LOGD("do rela, %lu leading relative relocations.\n", image->relative_rela_count);
+		do_relative_rela(base, (const elf_rela*) image->relative_rela, image->relative_rela_count);
+		if (!do_rela(base, (const elf_rela*) image->rela, image->rela_count, symtab, strtab)) return 0;
+	}
+	if (image->rel) {
+		LOGD("do rel, %lu leading relative relocations.\n", image->relative_rel_count);
+		do_relative_rel(base, (const elf_rel*) image->relative_rel, image->relative_rel_count);
+		if (!do_rel(base, (const elf_rel*) image->rel, image->rel_count, symtab, strtab)) return 0;
+	}
+	if (image->jmprel) {
+		LOGD("do jmprel with %s.\n", image->jmprel_is_rela ? "rela" : "rel");
+		if (!do_jmprel(image)) return 0;
+	}
+	return 1;
+}
+
+int do_dynamic_relocs(const loaded_image* image) {
+	DeferredRelocs deferred = { NULL, 0, 0 };
+	DeferredRelocs* outer = deferred_relocs; // a resolver or lazy binding may load another image
+	deferred_relocs = &deferred;
+	int ok = do_reloc_tables(image);
+	deferred_relocs = outer;
+	if (ok && deferred.count) {
+		LOGD("do %lu ifunc relocations.\n", (unsigned long) deferred.count);
+		const elf_sym* symtab = (const elf_sym*) image->symtab;
+		for (size_t i = 0; i < deferred.count && ok; i++) {
+			const DeferredReloc* entry = &deferred.entries[i];
+			ok = do_reloc(image->base, entry->offset, entry->info, entry->addend, symtab, image->strtab);
+		}
+	}
+	free(deferred.entries);
+	return ok;
+}
+
+static int for_each_rela(void* base, const elf_rela* rela, size_t count, const elf_sym* symtab, const char* strtab, reloc_visitor fn, void* arg) {
+	for (size_t i = 0; i < count; i++) {
+		if (!fn(arg, base, rela[i].r_offset, rela[i].r_info, rela[i].r_addend, symtab, strtab)) return 0;
+	}
+	return 1;
+}
+
+static int for_each_rel(void* base, const elf_rel* rel, size_t count, const elf_sym* symtab, const char* strtab, reloc_visitor fn, void* arg) {
+	for (size_t i = 0; i < count; i++) {
+		if (!fn(arg, base, rel[i].r_offset, rel[i].r_info, *(size_t*) ((size_t) base + rel[i].r_offset), symtab, strtab)) return 0;
+	}
+	return 1;
+}
+
+// calls fn(arg, ...) for every entry of DT_RELA, DT_REL, DT_JMPREL and android packed tables (not DT_RELR)
+int for_each_reloc(const loaded_image* image, reloc_visitor fn, void* arg) {
+	void* base = image->base;
+	const elf_sym* symtab = (const elf_sym*) image->symtab;
+	const char* strtab = image->strtab;
+	if (!for_each_rela(base, (const elf_rela*) image->relative_rela, image->relative_rela_count, symtab, strtab, fn, arg)) return 0;
+	if (!for_each_rela(base, (const elf_rela*) image->rela, image->rela_count, symtab, strtab, fn, arg)) return 0;
+	if (!for_each_rel(base, (const elf_rel*) image->relative_rel, image->relative_rel_count, symtab, strtab, fn, arg)) return 0;
+	if (!for_each_rel(base, (const elf_rel*) image->rel, image->rel_count, symtab, strtab, fn, arg)) return 0;
+	if (image->jmprel_is_rela) {
+		if (!for_each_rela(base, (const elf_rela*) image->jmprel, image->jmprel_count, symtab, strtab, fn, arg)) return 0;
+	} else {
+		if (!for_each_rel(base, (const elf_rel*) image->jmprel, image->jmprel_count, symtab, strtab, fn, arg)) return 0;
+	}
+	if (image->android_rela) {
+		if (!do_android_packed(base, image->android_rela, image->android_rela_size, 1, symtab, strtab, fn, arg)) return 0;
+	}
+	if (image->android_rel) {
+		if (!do_android_packed(base, image->android_rel, image->android_rel_size, 0, symtab, strtab, fn, arg)) return 0;
+	}
+	return 1;
+}
+
+// ask init_array_filter (or the user) whether to call each item, kind: "init" or "fini"
+static void call_function_array(void* base, void (**array)(), size_t count, int reverse, const char* kind) {
+	while (count && *array == NULL) {
+		array++;
+		count--;
+	}
+	if (count == 0) return;
+	lock_init(); // one at a time, also the prompts
+	LOGI("%s array detected:\n", kind);
+	int choice = '?';
+	for (size_t j = 0; j < count; j++) {
+		size_t i = reverse ? count - 1 - j : j;
+		if (!array[i]) continue;
+		while (!init_array_filter && choice != 'y' && choice != 'n' && choice != 'a' && choice != 'o') {
+			LOGI("\texecute function %p? [(y)es/(n)o/(a)ll items left/n(o)ne items left] ", array[i]);
+			choice = getchar();
+			if (choice != '\n') while (getchar() != '\n') ; // skip line
+			if (choice >= 'A' && choice <= 'Z') choice += 0x20; // convert to lower case
+		}
+		if (init_array_filter) {
+			if (init_array_filter(base, array[i])) {
+				LOGI("\texecuting function at %p...\n", array[i]);
+				array[i]();
+			} else {
+				LOGI("\t skipping function at %p...\n", array[i]);
+			}
+		} else if ((uchar) (choice - 'n') > 2) { // 'y' or 'a'
+			LOGI("\texecuting function at %p...\n", array[i]);
+			array[i]();
+			if (choice == 'y') choice = '?';
+		} else if (choice == 'n') choice = '?';
+	}
+	unlock_init();
+}
+
+void call_init_array(void* base, void (**init_array)(), size_t count) {
+	call_function_array(base, init_array, count, 0, "init");
+}
+
+// DT_INIT or DT_FINI
+static void call_function(void* base, void (*func)(), const char* kind) {
+	LOGI("%s proc detected: %p.\n", kind, func);
+	lock_init();
+	int choice = 'y';
+	if (!init_array_filter) {
+		do {
+			LOGI("Execute %s proc? [(y)es/(n)o] ", kind);
+			choice = getchar();
+			if (choice != '\n') while (getchar() != '\n') ;
+			if (choice >= 'A' && choice <= 'Z') choice += 0x20;
+		} while (choice != 'y' && choice != 'n');
+	} else if (init_array_filter(base, func)) {
+		choice = 'y';
+	} else {
+		choice = 'n';
+	}
+	if (choice == 'y') {
+		LOGI("\texecuting %s at %p...\n", kind, func);
+		func();
+	} else {
+		LOGI("\t skipping %s at %p...\n", kind, func);
+	}
+	unlock_init();
+}
+
+// DT_INIT and DT_INIT_ARRAY, filtered by init_array_filter
+void run_init(const loaded_image* image) {
+	if (image->init) {
+		call_function(image->base, image->init, "init");
+	}
+	if (image->init_array) {
+		call_init_array(image->base, image->init_array, image->init_array_count);
+	}
+}
+
+// DT_FINI_ARRAY (reversed) and DT_FINI, filtered by init_array_filter like init
+void run_fini(const loaded_image* image) {
+	if (image->fini_array) {
+		call_function_array(image->base, image->fini_array, image->fini_array_count, 1, "fini");
+	}
+	if (image->fini) {
+		call_function(image->base, image->fini, "fini");
+	}
+}
+
+// PF_X 1, PF_W 2, PF_R 4 to PROT_*
+int segment_prot(uint p_flags) {
+	return ((p_flags & 4) ? PROT_READ : 0) | ((p_flags & 2) ? PROT_WRITE : 0) | ((p_flags & 1) ? PROT_EXEC : 0);
+}
+
+static const elf_program_header* find_segment(const elf_program_header* phdrs, int phnum, size_t vaddr) {
+	for (int i = 0; i < phnum; i++) {
+		if (phdrs[i].p_type == 1 && vaddr - phdrs[i].p_vaddr < phdrs[i].p_memsz) return &phdrs[i]; // PT_LOAD
+	}
+	return NULL;
+}
+
+// DT_TEXTREL: pages of read-only segments written by relocations, writable only while relocating
+typedef struct TextrelPages {
+	const elf_program_header* phdrs;
+	int phnum;
+	size_t* pages; // page aligned offsets from base
+	size_t count;
+	size_t capacity;
+} TextrelPages;
+
+static __thread TextrelPages textrel = { NULL, 0, NULL, 0, 0 };
+
+static void add_textrel_page(size_t offset) {
+	const elf_program_header* segment = find_segment(textrel.phdrs, textrel.phnum, offset);
+	if (segment == NULL || (segment->p_flags & 2)) return; // PF_W
+	size_t page = offset & ~0xfff;
+	if (textrel.count && textrel.pages[textrel.count - 1] == page) return;
+	if (textrel.count == textrel.capacity) {
+		textrel.capacity = textrel.capacity ? textrel.capacity * 2 : 64;
+		textrel.pages = (size_t*) realloc(textrel.pages, textrel.capacity * sizeof(size_t));
+	}
+	textrel.pages[textrel.count++] = page;
+}
+
+static int collect_textrel_page(void* arg, void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab) {
+	add_textrel_page(offset);
+	add_textrel_page(offset + sizeof(size_t) - 1); // may cross a page
+	return 1;
+}
+
+static void collect_relr_pages(const size_t* relr, size_t count) {
+	size_t where = 0;
+	for (size_t i = 0; i < count; i++) {
+		if ((relr[i] & 1) == 0) {
+			where = relr[i];
+			add_textrel_page(where);
+			where += sizeof(size_t);
+		} else {
+			for (size_t bits = relr[i] >> 1, j = 0; bits; bits >>= 1, j++) {
+				if (bits & 1) add_textrel_page(where + j * sizeof(size_t));
+			}
+			where += (sizeof(size_t) * 8 - 1) * sizeof(size_t);
+		}
+	}
 }
 
-const elf_dyn* find_dyn_entry(const elf_dyn* dyn, int type) {
-	for (; dyn->d_tag != 0; dyn++) { // DT_NULL
-		if (dyn->d_tag == type) return dyn;
-	}
-	return NULL;
+static int compare_page(const void* a, const void* b) {
+	size_t x = *(const size_t*) a;
+	size_t y = *(const size_t*) b;
+	return x < y ? -1 : x > y;
 }
 
-int do_rel(void* base, const elf_rel* rel, int count, const elf_sym* symtab, const char* strtab) {
-	for (int i = 0; i < count; i++) {
-		if (!do_reloc(base, rel[i].r_offset, rel[i].r_info, *(size_t*) ((size_t) base + rel[i].r_offset), symtab, strtab))
-			return 0;
+// make_writable: add PROT_WRITE to collected pages, otherwise restore segment prot
+static void protect_textrel_pages(void* base, int make_writable) {
+	for (size_t i = 0; i < textrel.count; i++) {
+		const elf_program_header* segment = find_segment(textrel.phdrs, textrel.phnum, textrel.pages[i]);
+		int prot = segment_prot(segment->p_flags) | (make_writable ? PROT_WRITE : 0);
+		if (mprotect((void*) ((size_t) base + textrel.pages[i]), 0x1000, prot)) {
+			LOGW("failed to mprotect text relocation page +0x%lx.\n", textrel.pages[i]);
+		}
 	}
-	return 1;
 }
 
-int do_rela(void* base, const elf_rela* rela, int count, const elf_sym* symtab, const char* strtab) {
-	for (int i = 0; i < count; i++) {
-		if (!do_reloc(base, rela[i].r_offset, rela[i].r_info, rela[i].r_addend, symtab, strtab))
-			return 0;
+static void collect_textrel_pages(const loaded_image* image, const elf_program_header* phdrs, int phnum) {
+	textrel.phdrs = phdrs;
+	textrel.phnum = phnum;
+	textrel.count = 0;
+	for_each_reloc(image, collect_textrel_page, NULL);
+	if (image->relr) {
+		collect_relr_pages(image->relr, image->relr_count);
 	}
-	return 1;
+	qsort(textrel.pages, textrel.count, sizeof(size_t), compare_page);
+	size_t count = 0;
+	for (size_t i = 0; i < textrel.count; i++) {
+		if (count == 0 || textrel.pages[count - 1] != textrel.pages[i]) textrel.pages[count++] = textrel.pages[i];
+	}
+	textrel.count = count;
+	LOGD("%lu pages of read-only segments relocated.\n", count);
 }
 
-int check_and_do_rel(void* base, const elf_dyn* dyn, const elf_rel* rel, const elf_sym* symtab, const char* strtab) {
-	if (find_dyn_entry(dyn, 0x13)->d_un != sizeof(elf_rel)) { // DT_RELENT
-		LOGE("unexpected rel table entry size.\n");
-		return 0;
+// PT_GNU_RELRO is read-only once relocated
+void protect_relro(const loaded_image* image) {
+	if (image->relro == NULL) return;
+	LOGD("relro: %p - 0x%lx.\n", image->relro, (size_t) image->relro + image->relro_size);
+	if (mprotect(image->relro, image->relro_size, PROT_READ)) {
+		LOGW("failed to mprotect relro %p - 0x%lx.\n", image->relro, (size_t) image->relro + image->relro_size);
 	}
-	LOGD("do rel.\n");
-	int rel_count = find_dyn_entry(dyn, 0x12)->d_un / sizeof(elf_rel); // DT_RELSZ
-	if (!do_rel(base, rel, rel_count, symtab, strtab)) return 0;
-	return 1;
 }
 
-int check_and_do_rela(void* base, const elf_dyn* dyn, const elf_rela* rela, const elf_sym* symtab, const char* strtab) {
-	if (find_dyn_entry(dyn, 0x9)->d_un != sizeof(elf_rela)) { // DT_RELAENT
-		LOGE("unexpected rela table entry size.\n");
-		return 0;
+// pages in [addr, addr + size) that are present and no longer backed by the file (written or anonymous)
+size_t count_dirty_pages(void* addr, size_t size) {
+	int fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) return 0;
+	size_t dirty = 0;
+	ullong entries[512];
+	for (size_t page = (size_t) addr >> 12, end = ((size_t) addr + size + 0xfff) >> 12; page < end; ) {
+		size_t n = end - page < 512 ? end - page : 512;
+		if (pread(fd, entries, n * sizeof(ullong), page * sizeof(ullong)) != n * sizeof(ullong)) break;
+		for (size_t i = 0; i < n; i++) {
+			if ((entries[i] >> 63) & 1 && !((entries[i] >> 61) & 1)) dirty++; // present, not file-page/shared-anon
+		}
+		page += n;
 	}
-	LOGD("do rela.\n");
-	int rela_count = find_dyn_entry(dyn, 0x8)->d_un / sizeof(elf_rela); // DT_RELASZ
-	if (!do_rela(base, rela, rela_count, symtab, strtab)) return 0;
-	return 1;
+	close(fd);
+	return dirty;
 }
 
-int load_dynamic(void* base, const elf_dyn* dyn) {
-	const elf_dyn* res = find_dyn_entry(dyn, 5); // DT_STRTAB
-	if (res == NULL) {
-		LOGE("string table not found.\n");
-		return 0;
-	}
-	const char* strtab = (const char*) ((size_t) base + res->d_un);
+static __thread int defer_init = 0;
+
+void set_defer_init(int defer) {
+	defer_init = defer;
+}
+
+int load_dynamic(const loaded_image* image, const elf_program_header* phdrs, int phnum, const char* path) {
+	void* base = image->base;
+	int defer = defer_init;
+	defer_init = 0; // not for its DT_NEEDED
+	load_stats* stats = current_load_stats();
+	ullong start = stats_now();
+	load_needed_libraries(image, path);
+	stats->needed_ns = stats_now() - start;
+	start = stats_now();
 
-	const elf_sym* symtab = NULL;
-	res = find_dyn_entry(dyn, 0x6); // DT_SYMTAB
-	if (res != NULL) {
-		symtab = (const elf_sym*) ((size_t) base + res->d_un);
-		if (find_dyn_entry(dyn, 0xB)->d_un != sizeof(elf_sym)) { // DT_SYMENT
-			LOGE("unexpected symbol table entry size.\n");
+	const void** addrs = NULL;
+	if (image->symbol_count) {
+		addrs = (const void**) malloc(image->symbol_count * sizeof(void*));
+		if (addrs == NULL) {
+			LOGE("out of memory for the symbols of %p.\n", base);
 			return 0;
 		}
+		memset(addrs, 0xff, image->symbol_count * sizeof(void*)); // BADADDR
 	}
+	SymbolIndexCache saved_symbols = reloc_symbols;
+	reloc_symbols.count = image->symbol_count;
+	reloc_symbols.image = image;
+	reloc_symbols.addrs = addrs;
+	if (image->textrel) {
+		collect_textrel_pages(image, phdrs, phnum);
+		protect_textrel_pages(base, 1);
+	}
+	int reloc_ok = do_dynamic_relocs(image);
+	if (image->textrel) protect_textrel_pages(base, 0);
+	free(reloc_symbols.addrs);
+	reloc_symbols = saved_symbols;
+	if (!reloc_ok) return 0;
+	protect_relro(image);
+	stats->reloc_ns = stats_now() - start;
 
-	for (const elf_dyn* it = dyn; it->d_tag != 0; it++) {
-		if (it->d_tag != 1) continue; // DT_NEEDED: name of needed library
-		load_needed_library(strtab + it->d_un);
+	start = stats_now();
+	if (defer) {
+		LOGD("init of %p deferred.\n", base);
+	} else {
+		run_init(image);
 	}
+	stats->init_ns = stats_now() - start;
 
-	int rel_done = 0;
-	for (const elf_dyn* it = dyn; it->d_tag != 0; it++) { // DT_NULL
-		switch (it->d_tag) {
-		case 7: // DT_RELA
-			if (rel_done) break;
-			if (!check_and_do_rela(base, dyn, (const elf_rela*) ((size_t) base + it->d_un), symtab, strtab))
-				return 0;
-			rel_done = 1;
-			break;
-		case 0x11: // DT_REL
-			if (rel_done) break;
-			if (!check_and_do_rel(base, dyn, (const elf_rel*) ((size_t) base + it->d_un), symtab, strtab))
-				return 0;
-			rel_done = 1;
-			break;
-		case 0x17: // DT_JMPREL
-			;
-			size_t plt_rel_size = find_dyn_entry(dyn, 0x2)->d_un; // DT_PLTRELSZ
-			int plt_rel = find_dyn_entry(dyn, 0x14)->d_un; // DT_PLTREL
-			if (plt_rel == 0x11) { // DT_REL
-				if (!rel_done) {
-					res = find_dyn_entry(dyn, 0x11); // DT_REL
-					if (res != NULL) {
-						if (!check_and_do_rel(base, dyn, (const elf_rel*) ((size_t) base + res->d_un), symtab, strtab))
-							return 0;
-						rel_done = 1;
-					}
-				}
-				plt_rel_size /= sizeof(elf_rel);
-				LOGD("do jmprel with rel.\n");
-				if (!do_rel(base, (elf_rel*) ((size_t) base + it->d_un), plt_rel_size, symtab, strtab)) return 0;
-			} else if (plt_rel == 7) { // DT_RELA
-				if (!rel_done) {
-					res = find_dyn_entry(dyn, 7); // DT_RELA
-					if (res != NULL) {
-						if (!check_and_do_rela(base, dyn, (const elf_rela*) ((size_t) base + res->d_un), symtab, strtab))
-							return 0;
-						rel_done = 1;
-					}
-				}
-				plt_rel_size /= sizeof(elf_rela);
-				LOGD("do jmprel with rela.\n");
-				if (!do_rela(base, (elf_rela*) ((size_t) base + it->d_un), plt_rel_size, symtab, strtab)) return 0;
-			} else {
-				LOGE("unexpected plt rel type: %d.\n", plt_rel);
-				return 0;
+	start = stats_now();
+	if (image->fini) {
+		LOGI("fini proc detected: %p.\n", image->fini);
+	}
+
+	void (**fini_array)() = image->fini_array;
+	size_t count = image->fini_array_count;
+	while (count && *fini_array == NULL) {
+		fini_array++;
+		count--;
+	}
+	if (count) {
+		LOGI("fini array detected:\n");
+		for (size_t i = 0; i < count; i++) {
+			if (fini_array[i]) {
+				LOGI("\t%p\n", fini_array[i]);
 			}
-			break;
 		}
 	}
+	stats->fini_scan_ns = stats_now() - start;
+	LOGI("load_dynamic done.\n");
+	return 1;
+}
 
-	res = find_dyn_entry(dyn, 0xC); // DT_INIT
-	if (res != NULL) {
-		void (*init)() = (void (*)()) ((size_t) base + res->d_un);
-		LOGI("init proc detected: %p.\n", init);
-		int choice = 'y';
-		if (!init_array_filter) {
-			do {
-				LOGI("Execute init proc? [(y)es/(n)o] ");
-				choice = getchar();
-				if (choice != '\n') while (getchar() != '\n') ;
-				if (choice >= 'A' && choice <= 'Z') choice += 0x20;
-			} while (choice != 'y' && choice != 'n');
-		} else if (init_array_filter(base, init)) {
-			choice = 'y';
-		} else {
-			choice = 'n';
-		}
-		if (choice == 'y') {
-			LOGI("\texecuting init at %p...\n", init);
-			init();
+// where the elf is read from: [offset, offset + size) of fd, or memory
+typedef struct ElfSource {
+	int fd; // -1 for memory
+	const char* path; // NULL if not opened by path, for $ORIGIN
+	size_t offset;
+	size_t size;
+	const uchar* mem;
+	void* gz; // gzFile if fd is gzip compressed (WITH_ZLIB)
+	size_t window_start; // gz: last page read, segments may share a file page
+	size_t window_len;
+	uchar window[0x1000];
+} ElfSource;
+
+#ifdef WITH_ZLIB
+// decompressed sequentially, seeking backwards restarts the stream (gzseek)
+static int gz_read(ElfSource* src, void* buf, size_t size, size_t offset) {
+	while (size) {
+		size_t n;
+		if (offset >= src->window_start && offset < src->window_start + src->window_len) {
+			n = src->window_start + src->window_len - offset;
+			if (n > size) n = size;
+			memcpy(buf, src->window + offset - src->window_start, n);
 		} else {
-			LOGI("\t skipping init at %p...\n", init);
-		}
-	}
-
-	res = find_dyn_entry(dyn, 0x19); // DT_INIT_ARRAY
-	if (res != NULL) {
-		void (**init_array)() = (void (**)()) ((size_t) base + res->d_un);
-		int count = find_dyn_entry(dyn, 0x1B)->d_un / sizeof(size_t); // DT_INIT_ARRAYSZ
-		while (*init_array == NULL && count) {
-			init_array++;
-			count--;
-		}
-		if (count) {
-			LOGI("init array detected:\n");
-			int choice = '?';
-			for (int i = 0; i < count; i++) {
-				if (!init_array[i]) continue;
-				while (!init_array_filter && choice != 'y' && choice != 'n' && choice != 'a' && choice != 'o') {
-					LOGI("\texecute function %p? [(y)es/(n)o/(a)ll items left/n(o)ne items left] ", init_array[i]);
-					choice = getchar();
-					if (choice != '\n') while (getchar() != '\n') ; // skip line
-					if (choice >= 'A' && choice <= 'Z') choice += 0x20; // convert to lower case
-				}
-				if (init_array_filter) {
-					if (init_array_filter(base, init_array[i])) {
-						LOGI("\texecuting function at %p...\n", init_array[i]);
-						init_array[i]();
-					} else {
-						LOGI("\t skipping function at %p...\n", init_array[i]);
-					}
-				} else if ((uchar) (choice - 'n') > 2) { // 'y' or 'a'
-					LOGI("\texecuting function at %p...\n", init_array[i]);
-					init_array[i]();
-					if (choice == 'y') choice = '?';
-				} else if (choice == 'n') choice = '?';
-			}
+			if ((size_t) gztell(src->gz) != offset && gzseek(src->gz, offset, SEEK_SET) < 0) return 0;
+			int res = gzread(src->gz, buf, size < 0x40000000 ? size : 0x40000000);
+			if (res <= 0) return 0;
+			n = res;
+			src->window_len = n < sizeof(src->window) ? n : sizeof(src->window);
+			src->window_start = offset + n - src->window_len;
+			memcpy(src->window, (const void*) ((size_t) buf + n - src->window_len), src->window_len);
 		}
+		buf = (void*) ((size_t) buf + n);
+		offset += n;
+		size -= n;
 	}
+	return 1;
+}
+#endif
 
-	res = find_dyn_entry(dyn, 0xD); // DT_FINI
-	if (res != NULL) {
-		void (*fini)() = (void (*)()) ((size_t) base + res->d_un);
-		LOGI("fini proc detected: %p.\n", fini);
+static int source_read(ElfSource* src, void* buf, size_t size, size_t offset) {
+	if (offset > src->size || size > src->size - offset) return 0;
+	if (src->fd < 0) {
+		memcpy(buf, src->mem + offset, size);
+		return 1;
 	}
+#ifdef WITH_ZLIB
+	if (src->gz) return gz_read(src, buf, size, offset);
+#endif
+	for (size_t done = 0; done < size; ) {
+		ssize_t n = pread(src->fd, (void*) ((size_t) buf + done), size - done, src->offset + offset + done);
+		if (n <= 0) return 0;
+		done += n;
+	}
+	return 1;
+}
 
-	res = find_dyn_entry(dyn, 0x1A); // DT_FINI_ARRAY
-	if (res != NULL) {
-		void (**fini_array)() = (void (**)()) ((size_t) base + res->d_un);
-		int count = find_dyn_entry(dyn, 0x1C)->d_un / sizeof(size_t); // DT_FINI_ARRAYSZ
-		while (*fini_array == NULL && count) {
-			fini_array++;
-			count--;
-		}
-		if (count) {
-			LOGI("fini array detected:\n");
-			for (int i = 0; i < count; i++) {
-				if (fini_array[i]) {
-					LOGI("\t%p\n", fini_array[i]);
-				}
-			}
+// detect compressed fd by magic, 0 if it can't be read
+static int open_source(ElfSource* src) {
+	uchar magic[4] = { 0 };
+	if (pread(src->fd, magic, sizeof(magic), src->offset) < 2) return 1; // check_header reports it
+	if (magic[0] == 0x1f && magic[1] == 0x8b) { // gzip
+#ifdef WITH_ZLIB
+		LOGI("gzip compressed, decompressing segments in place\n");
+		int fd = dup(src->fd);
+		if (fd < 0 || lseek(fd, src->offset, SEEK_SET) != (off_t) src->offset || (src->gz = gzdopen(fd, "rb")) == NULL) {
+			LOGE("failed to open gzip stream.\n");
+			if (fd >= 0) close(fd);
+			return 0;
 		}
+		src->size = (size_t) -1; // unknown until decompressed
+		return 1;
+#else
+		LOGE("gzip compressed elf, build with WITH_ZLIB (see Makefile).\n");
+		return 0;
+#endif
+	}
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+		LOGE("zstd compressed elf is not supported.\n");
+		return 0;
 	}
-	LOGI("load_dynamic done.\n");
 	return 1;
 }
 
-int load_static(void* base, int fd, elf_header* header) {
+static void close_source(ElfSource* src) {
+#ifdef WITH_ZLIB
+	if (src->gz) gzclose(src->gz); // closes the dup fd
+#endif
+	src->gz = NULL;
+}
+
+int load_static(void* base, ElfSource* src, elf_header* header) {
 	if (header->e_shentsize != sizeof(elf_section_header)) {
 		LOGW("Unexpected section header entry size, skipped load_static\n");
 		return 1; // something went wrong, maybe nothing important
@@ -395,15 +1728,13 @@ int load_static(void* base, int fd, elf_header* header) {
 		return 0;
 	}
 	elf_section_header sheader;
-	lseek(fd, header->e_shoff + sizeof(elf_section_header) * header->e_shtrndx, SEEK_SET);
-	if (read(fd, &sheader, sizeof(sheader)) != sizeof(sheader)) {
+	if (!source_read(src, &sheader, sizeof(sheader), header->e_shoff + sizeof(elf_section_header) * header->e_shtrndx)) {
 		LOGE("read section header error\n");
 		return 0;
 	}
 	size_t strtab_size = sheader.s_size;
 	char* strtab = (char*) malloc(strtab_size + 1);
-	lseek(fd, sheader.s_offset, SEEK_SET);
-	if (read(fd, strtab, strtab_size) != strtab_size) {
+	if (!source_read(src, strtab, strtab_size, sheader.s_offset)) {
 		LOGE("read section header string table error\n");
 		free(strtab);
 		return 0;
@@ -417,15 +1748,15 @@ int load_static(void* base, int fd, elf_header* header) {
 	// if you indeed need to call init, call in your main or init_array_filter.
 	// void (*init)() = NULL;
 	void (**init_array)() = NULL;
-	size_t init_array_count;
+	size_t init_array_count = 0;
 	// ignored fini
 	// same as init
 	// void (*fini)() = NULL;
 	void (**fini_array)() = NULL;
-	size_t fini_array_count;
-	lseek(fd, header->e_shoff, SEEK_SET);
+	size_t fini_array_count = 0;
+	ullong start;
 	for (int i = 0; i < header->e_shnum; i++) {
-		if (read(fd, &sheader, sizeof(sheader)) != sizeof(sheader)) {
+		if (!source_read(src, &sheader, sizeof(sheader), header->e_shoff + sizeof(elf_section_header) * i)) {
 			LOGE("read section header error\n");
 			free(strtab);
 			return 0;
@@ -456,7 +1787,9 @@ int load_static(void* base, int fd, elf_header* header) {
 			LOGD("detected rela\n");
 			// All items should be R_IRELATIVE
 			// Here we just ignore this check
+			start = stats_now();
 			do_rela(base, (elf_rela*) ((size_t) base + sheader.s_addr), sheader.s_size / sizeof(elf_rela), NULL, NULL);
+			current_load_stats()->reloc_ns += stats_now() - start;
 			break;
 		case 9: // SHT_REL
 			if (sheader.s_entsize != sizeof(elf_rel)) {
@@ -472,7 +1805,9 @@ int load_static(void* base, int fd, elf_header* header) {
 			LOGD("detected rel\n");
 			// All items should be R_IRELATIVE
 			// Here we just ignore this check
+			start = stats_now();
 			do_rel(base, (elf_rel*) ((size_t) base + sheader.s_addr), sheader.s_size / sizeof(elf_rel), NULL, NULL);
+			current_load_stats()->reloc_ns += stats_now() - start;
 			break;
 		case 14: // SHT_INIT_ARRAY
 			init_array = (void*) ((size_t) base + sheader.s_addr);
@@ -507,31 +1842,12 @@ int load_static(void* base, int fd, elf_header* header) {
 		}
 	}
 	free(strtab);
+	start = stats_now();
 	if (init_array && init_array_count) {
-		LOGI("init array detected:\n");
-		int choice = '?';
-		for (int i = 0; i < init_array_count; i++) {
-			if (!init_array[i]) continue;
-			while (!init_array_filter && choice != 'y' && choice != 'n' && choice != 'a' && choice != 'o') {
-				LOGI("\texecute function %p? [(y)es/(n)o/(a)ll items left/n(o)ne items left] ", init_array[i]);
-				choice = getchar();
-				if (choice != '\n') while (getchar() != '\n') ; // skip line
-				if (choice >= 'A' && choice <= 'Z') choice += 0x20; // convert to lower case
-			}
-			if (init_array_filter) {
-				if (init_array_filter(base, init_array[i])) {
-					LOGI("\texecuting function at %p...\n", init_array[i]);
-					init_array[i]();
-				} else {
-					LOGI("\t skipping function at %p...\n", init_array[i]);
-				}
-			} else if ((uchar) (choice - 'n') > 2) { // 'y' or 'a'
-				LOGI("\texecuting function at %p...\n", init_array[i]);
-				init_array[i]();
-				if (choice == 'y') choice = '?';
-			} else if (choice == 'n') choice = '?';
-		}
+		call_init_array(base, init_array, init_array_count);
 	}
+	current_load_stats()->init_ns = stats_now() - start;
+	start = stats_now();
 	if (fini_array && fini_array_count) {
 		LOGI("fini array detected:\n");
 		for (int i = 0; i < fini_array_count; i++) {
@@ -540,160 +1856,289 @@ int load_static(void* base, int fd, elf_header* header) {
 			}
 		}
 	}
+	current_load_stats()->fini_scan_ns = stats_now() - start;
 	LOGI("load_static done.\n");
 	return 1;
 }
 
-void* load_with_mmap(const char* path) {
-	LOGI("loading %s with mmap...\n", path);
-	int fd = open(path, O_RDONLY);
-	LOGV("open(path, O_RDONLY) returns %d\n", fd);
-	if (fd < 0) {
-		LOGE("file `%s' not found.\n", path);
-		return BADADDR;
+static void* load_base = MMAP_LOAD_BASE;
+static int load_options = 0;
+
+void set_load_base(void* base) {
+	load_base = base;
+}
+
+void set_load_options(int options) {
+	load_options = options;
+}
+
+// PROT_NONE mapping of [base + min_vaddr, base + min_vaddr + span), returns base
+static void* reserve_image(int is_pie, size_t min_vaddr, size_t span) {
+	void* addr;
+	if (!is_pie) {
+		LOGI("not pie\n");
+		addr = (void*) min_vaddr;
+	} else if (load_base == NULL) {
+		LOGI("pie, base chosen by kernel\n");
+		size_t align = (load_options & LOAD_HUGEPAGE) ? HUGE_PAGE_SIZE : 0x1000;
+		addr = mmap(NULL, span + align - 0x1000, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) {
+			LOGE("failed to reserve 0x%lx bytes.\n", span);
+			return BADADDR;
+		}
+		// trim to an aligned base
+		size_t aligned = ((size_t) addr - min_vaddr + align - 1) / align * align + min_vaddr;
+		size_t lead = aligned - (size_t) addr;
+		size_t trail = align - 0x1000 - lead;
+		if (lead) munmap(addr, lead);
+		if (trail) munmap((void*) (aligned + span), trail);
+		return (void*) (aligned - min_vaddr);
+	} else {
+		LOGI("pie\n");
+		size_t base = (size_t) load_base;
+		if (load_options & LOAD_HUGEPAGE) base = (base + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		addr = (void*) (base + min_vaddr);
+	}
+	LOGV("determine LOAD_BASE...\n");
+	while (1) {
+		void* res = mmap(addr, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (res == addr) break;
+		if (res != MAP_FAILED) munmap(res, span); // MAP_FIXED_NOREPLACE unknown to kernel, got a hint
+		if (!is_pie || (size_t) addr + 0x1000000 < (size_t) addr) {
+			LOGE("failed to reserve %p, size 0x%lx.\n", addr, span);
+			return BADADDR;
+		}
+		addr = (void*) ((size_t) addr + 0x1000000);
+	}
+	return (void*) ((size_t) addr - min_vaddr);
+}
+
+// file part of a PT_LOAD, mapped from fd if it's page aligned in the file,
+// otherwise copied (from memory, compressed files, unaligned container entries, or to huge pages with LOAD_HUGEPAGE)
+static int map_segment(ElfSource* src, void* addr, size_t size, int prot, size_t file_offset, size_t file_size) {
+	int huge = (load_options & LOAD_HUGEPAGE) && (prot & PROT_EXEC) && size >= HUGE_PAGE_SIZE;
+	if (huge || src->fd < 0 || src->gz || (src->offset & 0xfff)) {
+		if (addr != mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)) return 0;
+		// page cache of most filesystems can't be mapped with huge pages, anonymous memory can
+		if (huge && madvise(addr, size, MADV_HUGEPAGE)) {
+			LOGW("madvise(MADV_HUGEPAGE) failed, transparent huge pages disabled?\n");
+		}
+		if (!source_read(src, addr, file_size, file_offset)) return 0; // the rest stays zero
+		LOGD("copied 0x%lx bytes to %p\n", size, addr);
+		return mprotect(addr, size, prot) == 0;
 	}
+	int flags = MAP_PRIVATE | MAP_FIXED;
+	if ((load_options & LOAD_POPULATE) && !(prot & PROT_WRITE)) flags |= MAP_POPULATE; // populating writable private pages would copy them
+	if (addr != mmap(addr, size, prot, flags, src->fd, src->offset + file_offset)) return 0;
+	if ((load_options & LOAD_POPULATE) && (prot & PROT_WRITE)) madvise(addr, size, MADV_WILLNEED);
+	return 1;
+}
 
+static void* load_image(ElfSource* src, load_stats* stats) {
+	ullong start = stats_now();
 	elf_header header;
-	LOGV("reading elf header from file...\n");
-	if (read(fd, &header, sizeof(header)) != sizeof(header)) {
+	LOGV("reading elf header...\n");
+	if (!source_read(src, &header, sizeof(header), 0)) {
 		LOGE("read header error\n");
-		close(fd);
 		return BADADDR;
 	}
 	LOGV("checking elf header...\n");
 	if (!check_header(&header)) {
-		close(fd);
 		return BADADDR;
 	}
 
-	elf_program_header pheader;
-	elf_dyn* dyn = NULL;
-
 	int e_phentsize = header.e_phentsize;
 	int e_phnum = header.e_phnum;
 
-	if (e_phentsize != sizeof(pheader)) {
+	if (e_phentsize != sizeof(elf_program_header)) {
 		LOGE("unexpected program header size.\n");
-		close(fd);
 		return BADADDR;
 	}
 
-	int is_pie; // simple detection, not exact
-	LOGV("determine pie:\n");
-	lseek(fd, header.e_phoff, SEEK_SET);
+	elf_program_header* phdrs = (elf_program_header*) malloc(e_phnum * sizeof(elf_program_header));
+	LOGV("reading program headers...\n");
+	if (!source_read(src, phdrs, e_phnum * sizeof(elf_program_header), header.e_phoff)) {
+		LOGE("read pheader error\n");
+		free(phdrs);
+		return BADADDR;
+	}
+
+	int is_pie = 0; // simple detection, not exact
+	size_t min_vaddr = (size_t) -1;
+	size_t max_vaddr = 0;
+	LOGV("determine pie and image span:\n");
 	for (int i = 0; i < e_phnum; i++) {
-		LOGV("scanning phdr %d...\n", i);
-		if (read(fd, &pheader, sizeof(pheader)) != sizeof(pheader)) {
-			LOGE("read pheader error\n");
-			close(fd);
-			return BADADDR;
-		}
-		if (pheader.p_type != 1 || pheader.p_memsz == 0) { // not PT_LOAD or nothing to load
+		const elf_program_header* pheader = &phdrs[i];
+		if (pheader->p_type != 1 || pheader->p_memsz == 0) { // not PT_LOAD or nothing to load
 			continue;
 		}
-		if (pheader.p_offset != 0) { // not header
-			continue;
-		}
-		if (pheader.p_vaddr == 0) {
-			is_pie = 1; // load 0 to 0 (pie)
-		} else {
-			is_pie = 0; // load 0 to 0x??? (maybe not pie)
+		if ((pheader->p_vaddr & ~0xfff) < min_vaddr) min_vaddr = pheader->p_vaddr & ~0xfff;
+		if (pheader->p_vaddr + pheader->p_memsz > max_vaddr) max_vaddr = pheader->p_vaddr + pheader->p_memsz;
+		if (pheader->p_offset == 0) { // header
+			is_pie = pheader->p_vaddr == 0; // load 0 to 0 (pie), or load 0 to 0x??? (maybe not pie)
 		}
-		break;
 	}
-	void* base;
-	if (is_pie) {
-		LOGI("pie\n");
-		base = MMAP_LOAD_BASE;
-		LOGV("determine LOAD_BASE...\n");
-		while (base != mmap(base, 0x1000, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) {
-			base = (void*) ((size_t) base + 0x1000000);
-		}
-		munmap(base, 0x1000);
-	} else {
-		LOGI("not pie\n");
-		base = NULL;
+	if (max_vaddr == 0) {
+		LOGE("no PT_LOAD to load.\n");
+		free(phdrs);
+		return BADADDR;
+	}
+	size_t span = ((max_vaddr + 0xfff) & ~0xfff) - min_vaddr;
+	stats->header_ns = stats_now() - start;
+
+	// reserve the whole span at once, segments are mapped into it with MAP_FIXED
+	start = stats_now();
+	void* base = reserve_image(is_pie, min_vaddr, span);
+	stats->reserve_ns = stats_now() - start;
+	if (base == BADADDR) {
+		free(phdrs);
+		return BADADDR;
 	}
+	void* reserved = (void*) ((size_t) base + min_vaddr);
 	LOGD("trying loading at %p\n", base);
 
-	lseek(fd, header.e_phoff, SEEK_SET);
+	elf_dyn* dyn = NULL;
+	ullong mmap_start = stats_now();
 	for (int i = 0; i < e_phnum; i++) {
 		LOGV("processing phdr %d...\n", i);
-		if (read(fd, &pheader, sizeof(pheader)) != sizeof(pheader)) {
-			LOGE("read pheader error\n");
-			close(fd);
-			return BADADDR;
-		}
-		if (pheader.p_type != 1 || pheader.p_memsz == 0) { // not PT_LOAD or nothing to load
-			if (pheader.p_type == 2) { // DYNAMIC
+		const elf_program_header* pheader = &phdrs[i];
+		if (pheader->p_type != 1 || pheader->p_memsz == 0) { // not PT_LOAD or nothing to load
+			if (pheader->p_type == 2) { // DYNAMIC
 				if (dyn != NULL) {
 					LOGE("duplicated DYNAMIC PHT detected.\n");
-					close(fd);
-					return BADADDR;
+					goto fail;
 				} else {
-					dyn = (elf_dyn*) ((size_t) base + pheader.p_vaddr);
+					dyn = (elf_dyn*) ((size_t) base + pheader->p_vaddr);
 				}
 			}
 			continue;
 		}
-		void* addr = (void*) (((size_t) base + pheader.p_vaddr) & ~0xfff);
-		int offset = pheader.p_vaddr & 0xfff;
-		size_t size = (offset + pheader.p_filesz + 0xfff) & ~0xfff;
-		if (addr != mmap(addr, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE, fd, pheader.p_offset - offset)) {
-			LOGE("failed to mmap 0x%lx to 0x%lx.\n", pheader.p_offset, pheader.p_vaddr + (size_t) base);
-			close(fd);
-			return BADADDR;
-		}
-		if (offset) {
-			memset(addr, 0, offset); // not exactly needed
+		if (pheader->p_memsz < pheader->p_filesz) {
+			LOGE("unexpected: filesz bigger than memsz.\n");
+			goto fail;
 		}
-		if (pheader.p_memsz != pheader.p_filesz) {
-			if (pheader.p_memsz < pheader.p_filesz) {
-				LOGE("unexpected: filesz bigger than memsz.\n");
-				close(fd);
-				return BADADDR;
+		start = stats_now();
+		int prot = segment_prot(pheader->p_flags);
+		void* addr = (void*) (((size_t) base + pheader->p_vaddr) & ~0xfff);
+		int offset = pheader->p_vaddr & 0xfff;
+		size_t size = (offset + pheader->p_filesz + 0xfff) & ~0xfff;
+		size_t tail = size - offset - pheader->p_filesz; // bytes after filesz in the last file page
+		if (tail > pheader->p_memsz - pheader->p_filesz) tail = pheader->p_memsz - pheader->p_filesz;
+		if (size) {
+			// the last file page is zeroed after filesz, writable until then
+			if (!map_segment(src, addr, size, tail ? prot | PROT_WRITE : prot, pheader->p_offset - offset, offset + pheader->p_filesz)) {
+				LOGE("failed to mmap 0x%lx to 0x%lx.\n", pheader->p_offset, pheader->p_vaddr + (size_t) base);
+				goto fail;
 			}
-			if (pheader.p_memsz + offset > size) {
-				LOGV("mmap extra pages in memory\n");
-				addr = (void*) ((size_t) addr + size);
-				if (addr != mmap(addr, pheader.p_memsz + offset - size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_ANON | MAP_SHARED, -1, 0)) {
-					LOGE("failed to mmap 0x%lx to 0x%lx.\n", pheader.p_offset, pheader.p_vaddr + (size_t) base);
-					close(fd);
-					return BADADDR;
-				}
+			if (tail) {
+				memset((void*) ((size_t) base + pheader->p_vaddr + pheader->p_filesz), 0, tail);
+				if (!(prot & PROT_WRITE)) mprotect(addr, size, prot);
 			}
-			memset((void*) ((size_t) base + pheader.p_vaddr + pheader.p_filesz), 0, pheader.p_memsz - pheader.p_filesz);
 		}
-		{
+		if (pheader->p_memsz + offset > size) {
+			LOGV("mmap extra pages in memory\n");
+			// private anonymous pages are zero and stay clean until written
+			void* bss = (void*) ((size_t) addr + size);
+			if (bss != mmap(bss, pheader->p_memsz + offset - size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)) {
+				LOGE("failed to mmap 0x%lx to 0x%lx.\n", pheader->p_offset, pheader->p_vaddr + (size_t) base);
+				goto fail;
+			}
+		}
+		if (prot & PROT_READ) {
 			LOGV("testing memory...\n");
-			char c = *(unsigned char*) (pheader.p_vaddr + (size_t) base);
-			c = *(unsigned char*) (pheader.p_vaddr + (size_t) base + pheader.p_filesz - 1);
-			c = *(unsigned char*) (pheader.p_vaddr + (size_t) base + pheader.p_memsz - 1);
+			char c = *(unsigned char*) (pheader->p_vaddr + (size_t) base);
+			c = *(unsigned char*) (pheader->p_vaddr + (size_t) base + pheader->p_memsz - 1);
 			c++; // to avoid warning: c not used
 		}
-		LOGD("mmaped 0x%lx to 0x%lx, filesz 0x%lx, memsz 0x%lx\n", pheader.p_offset, pheader.p_vaddr + (size_t) base, pheader.p_filesz, pheader.p_memsz);
+		LOGD("mmaped 0x%lx to 0x%lx, filesz 0x%lx, memsz 0x%lx, prot %d\n", pheader->p_offset, pheader->p_vaddr + (size_t) base, pheader->p_filesz, pheader->p_memsz, prot);
+		if (stats->segment_count < LOAD_STATS_MAX_SEGMENTS) stats->segment_ns[stats->segment_count] = stats_now() - start;
+		stats->segment_count++;
 	}
+	stats->mmap_ns = stats_now() - mmap_start;
 	LOGI("mmap done\n");
+	loaded_image parsed;
+	if (!parse_image(&parsed, base, dyn, phdrs, e_phnum)) goto fail;
+	const loaded_image* image = register_image(reserved, span, &parsed, src->path); // before DT_NEEDED are loaded, they are recorded in it
 
 	if (dyn) {
 		LOGI("DYNAMIC detected, loading...\n");
-		if (!load_dynamic(base, dyn)) {
-			close(fd);
-			return BADADDR;
-		}
+		if (!load_dynamic(image, phdrs, e_phnum, src->path)) goto fail;
 	} else {
 		LOGI("No DYNAMIC, checking static symbols...\n");
-		if (!load_static(base, fd, &header)) {
-			close(fd);
-			return BADADDR;
-		}
+		if (!load_static(base, src, &header)) goto fail;
 	}
+	if (dyn) record_loaded_library(image, src->path);
+	set_load_stats_pages(reserved, span);
 	LOGI("done, loaded at %p\n", base);
 
+	free(phdrs);
+	return base;
+
+fail:
+	discard_image(base);
+	munmap(reserved, span);
+	free(phdrs);
+	return BADADDR;
+}
+
+void* load_from_source(ElfSource* src) {
+	load_stats outer;
+	enter_load_stats(&outer);
+	load_stats* stats = current_load_stats();
+	ullong start = stats_now();
+	void* base = load_image(src, stats);
+	stats->total_ns = stats_now() - start;
+	leave_load_stats(&outer);
+	return base;
+}
+
+void* load_with_mmap(const char* path) {
+	LOGI("loading %s with mmap...\n", path);
+	int fd = open(path, O_RDONLY);
+	LOGV("open(path, O_RDONLY) returns %d\n", fd);
+	if (fd < 0) {
+		LOGE("file `%s' not found.\n", path);
+		return BADADDR;
+	}
+	struct stat st;
+	if (fstat(fd, &st)) {
+		LOGE("fstat `%s' error.\n", path);
+		close(fd);
+		return BADADDR;
+	}
+	ElfSource src = { fd, path, 0, st.st_size, NULL };
+	void* base = open_source(&src) ? load_from_source(&src) : BADADDR;
+	close_source(&src);
 	close(fd);
 	return base;
 }
 
+// size 0: to the end of the file
+void* load_with_mmap_fd(int fd, off_t offset, size_t size) {
+	LOGI("loading fd %d at 0x%lx with mmap...\n", fd, (size_t) offset);
+	if (size == 0) {
+		struct stat st;
+		if (fstat(fd, &st) || st.st_size < offset) {
+			LOGE("fstat fd %d error.\n", fd);
+			return BADADDR;
+		}
+		size = st.st_size - offset;
+	}
+	if (offset & 0xfff) {
+		LOGI("entry not page aligned, segments are copied\n");
+	}
+	ElfSource src = { fd, NULL, offset, size, NULL };
+	void* base = open_source(&src) ? load_from_source(&src) : BADADDR;
+	close_source(&src);
+	return base;
+}
+
+void* load_with_mmap_mem(const void* buf, size_t len) {
+	LOGI("loading %p (0x%lx bytes) with mmap...\n", buf, len);
+	ElfSource src = { -1, NULL, 0, len, (const uchar*) buf };
+	return load_from_source(&src);
+}
+
 const elf_dyn* get_dyn(void* base) {
 	elf_header* header = (elf_header*) base;
 	int e_phnum = header->e_phnum;
@@ -706,34 +2151,329 @@ const elf_dyn* get_dyn(void* base) {
 	return NULL;
 }
 
-void* get_symbol_by_name(void* base, const char* symbol) {
-	const elf_dyn* dyn = get_dyn(base);
-	const char* strtab = (const char*) (find_dyn_entry(dyn, 5)->d_un); // DT_STRTAB
+// d_un of a pointer entry, relocated by base if needed
+static const void* dyn_ptr(void* base, size_t d_un) {
+	if (d_un < (size_t) base) // not relocated by ld.so
+		return (const void*) ((size_t) base + d_un);
+	return (const void*) d_un;
+}
+
+static uint sysv_hash(const char* name) {
+	uint h = 0;
+	for (; *name; name++) {
+		h = (h << 4) + (uchar) *name;
+		uint g = h & 0xf0000000;
+		if (g) h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+// DT_GNU_HASH: nbuckets, symoffset, bloom_size, bloom_shift, bloom[bloom_size], buckets[nbuckets], chain[]
+static const elf_sym* gnu_hash_lookup(const uint* hashtab, const elf_sym* symtab, const char* strtab, const char* symbol) {
+	uint nbuckets = hashtab[0];
+	uint symoffset = hashtab[1];
+	uint bloom_size = hashtab[2];
+	uint bloom_shift = hashtab[3];
+	const size_t* bloom = (const size_t*) (hashtab + 4);
+	const uint* buckets = (const uint*) (bloom + bloom_size);
+	const uint* chain = buckets + nbuckets;
+	if (nbuckets == 0 || bloom_size == 0) return NULL;
+
+	const uint bits = sizeof(size_t) * 8;
+	uint h = symbol_hash(symbol);
+	size_t word = bloom[(h / bits) % bloom_size];
+	size_t mask = ((size_t) 1 << (h % bits)) | ((size_t) 1 << ((h >> bloom_shift) % bits));
+	if ((word & mask) != mask) return NULL;
 
-	if (strtab < (const char*) base)
-		strtab = (const char*) strtab + (size_t) base;
-	size_t strsz = find_dyn_entry(dyn, 0xa)->d_un; // DT_STRSZ
-	const elf_sym* symtab = (const elf_sym*) (find_dyn_entry(dyn, 6)->d_un); // DT_SYMTAB
-	if ((const char*) symtab < (const char*) base)
-		symtab = (const elf_sym*) ((const char*) symtab + (size_t) base);
+	uint i = buckets[h % nbuckets];
+	if (i < symoffset) return NULL;
+	for (; ; i++) {
+		uint h2 = chain[i - symoffset];
+		if ((h | 1) == (h2 | 1) && strcmp(strtab + symtab[i].st_name, symbol) == 0) {
+			return &symtab[i];
+		}
+		if (h2 & 1) return NULL; // end of chain
+	}
+}
+
+// DT_HASH: nbucket, nchain, bucket[nbucket], chain[nchain]
+static const elf_sym* sysv_hash_lookup(const uint* hashtab, const elf_sym* symtab, const char* strtab, const char* symbol) {
+	uint nbucket = hashtab[0];
+	const uint* bucket = hashtab + 2;
+	const uint* chain = bucket + nbucket;
+	if (nbucket == 0) return NULL;
+
+	for (uint i = bucket[sysv_hash(symbol) % nbucket]; i != 0; i = chain[i]) {
+		if (symtab[i].shndx == 0) continue; // SHN_UNDEF
+		if (strcmp(strtab + symtab[i].st_name, symbol) == 0) {
+			return &symtab[i];
+		}
+	}
+	return NULL;
+}
 
+static const elf_sym* linear_lookup(const elf_sym* symtab, const char* strtab, size_t strsz, const char* symbol) {
 	for (; ; symtab++) {
 		if (symtab->st_name == 0) continue;
 		if (symtab->st_name >= strsz) {
-			// LOGE("failed to resolve symbol `%s' from library (%p): not found.\n", symbol, base);
 			return NULL;
 		}
 		if (strcmp(strtab + symtab->st_name, symbol) == 0) {
-			if (symtab->st_value == 0) {
-				// LOGE("failed to resolve symbol `%s' from library (%p): value is NULL.\n", symbol, base);
-				return NULL;
-			}
-			if (elf_st_type(symtab->st_info) != 10) { // STT_GNU_IFUNC
-				return (void*) ((size_t) base + symtab->st_value);
+			return symtab;
+		}
+	}
+}
+
+// number of DT_SYMTAB entries, from DT_HASH nchain or the end of the last DT_GNU_HASH chain
+static size_t count_symbols(const uint* gnu_hash, const uint* sysv_hash) {
+	if (sysv_hash) {
+		return sysv_hash[1];
+	}
+	if (gnu_hash) {
+		uint nbuckets = gnu_hash[0];
+		uint symoffset = gnu_hash[1];
+		const uint* buckets = (const uint*) ((const size_t*) (gnu_hash + 4) + gnu_hash[2]);
+		const uint* chain = buckets + nbuckets;
+		uint last = 0;
+		for (uint i = 0; i < nbuckets; i++) {
+			if (buckets[i] > last) last = buckets[i];
+		}
+		if (last < symoffset) return symoffset;
+		while (!(chain[last - symoffset] & 1)) last++;
+		return last + 1;
+	}
+	return 0;
+}
+
+int parse_image(loaded_image* image, void* base, const elf_dyn* dyn, const elf_program_header* phdrs, int phnum) {
+	memset(image, 0, sizeof(loaded_image));
+	image->base = base;
+	image->dyn = dyn;
+	for (int i = 0; i < phnum; i++) {
+		if (phdrs[i].p_type == 7) { // PT_TLS
+			image->tls_image = (const void*) ((size_t) base + phdrs[i].p_vaddr);
+			image->tls_filesz = phdrs[i].p_filesz;
+			image->tls_memsz = phdrs[i].p_memsz;
+			image->tls_align = phdrs[i].p_align;
+		} else if (phdrs[i].p_type == 0x6474e552) { // PT_GNU_RELRO, partial last page stays writable (as ld.so)
+			size_t start = ((size_t) base + phdrs[i].p_vaddr) & ~0xfff;
+			size_t end = ((size_t) base + phdrs[i].p_vaddr + phdrs[i].p_memsz) & ~0xfff;
+			if (end > start) {
+				image->relro = (void*) start;
+				image->relro_size = end - start;
 			}
-			return ((void* (*)()) ((size_t) base + symtab->st_value))();
 		}
 	}
+	if (dyn == NULL) return 1;
+
+	const elf_rela* rela = NULL;
+	const elf_rel* rel = NULL;
+	const size_t* android_relr = NULL;
+	size_t relasz = 0, relaent = sizeof(elf_rela), relacount = 0;
+	size_t relsz = 0, relent = sizeof(elf_rel), relcount = 0;
+	size_t relrsz = 0, relrent = sizeof(size_t), android_relrsz = 0;
+	size_t pltrelsz = 0, pltrel = 0, syment = sizeof(elf_sym), flags = 0, flags_1 = 0;
+	const elf_dyn* soname = NULL;
+	const elf_dyn* rpath = NULL;
+	const elf_dyn* runpath = NULL;
+	for (const elf_dyn* it = dyn; it->d_tag != 0; it++) { // DT_NULL
+		switch (it->d_tag) {
+		case 2: pltrelsz = it->d_un; break; // DT_PLTRELSZ
+		case 3: image->pltgot = (size_t*) dyn_ptr(base, it->d_un); break; // DT_PLTGOT
+		case 4: image->sysv_hash = (const uint*) dyn_ptr(base, it->d_un); break; // DT_HASH
+		case 5: image->strtab = (const char*) dyn_ptr(base, it->d_un); break; // DT_STRTAB
+		case 6: image->symtab = dyn_ptr(base, it->d_un); break; // DT_SYMTAB
+		case 7: rela = (const elf_rela*) dyn_ptr(base, it->d_un); break; // DT_RELA
+		case 8: relasz = it->d_un; break; // DT_RELASZ
+		case 9: relaent = it->d_un; break; // DT_RELAENT
+		case 0xA: image->strsz = it->d_un; break; // DT_STRSZ
+		case 0xB: syment = it->d_un; break; // DT_SYMENT
+		case 0xC: image->init = (void (*)()) dyn_ptr(base, it->d_un); break; // DT_INIT
+		case 0xD: image->fini = (void (*)()) dyn_ptr(base, it->d_un); break; // DT_FINI
+		case 0xE: soname = it; break; // DT_SONAME
+		case 0xF: rpath = it; break; // DT_RPATH
+		case 0x11: rel = (const elf_rel*) dyn_ptr(base, it->d_un); break; // DT_REL
+		case 0x12: relsz = it->d_un; break; // DT_RELSZ
+		case 0x13: relent = it->d_un; break; // DT_RELENT
+		case 0x14: pltrel = it->d_un; break; // DT_PLTREL
+		case 0x16: image->textrel = 1; break; // DT_TEXTREL
+		case 0x17: image->jmprel = dyn_ptr(base, it->d_un); break; // DT_JMPREL
+		case 0x18: image->bind_now = 1; break; // DT_BIND_NOW
+		case 0x19: image->init_array = (void (**)()) dyn_ptr(base, it->d_un); break; // DT_INIT_ARRAY
+		case 0x1A: image->fini_array = (void (**)()) dyn_ptr(base, it->d_un); break; // DT_FINI_ARRAY
+		case 0x1B: image->init_array_count = it->d_un / sizeof(size_t); break; // DT_INIT_ARRAYSZ
+		case 0x1C: image->fini_array_count = it->d_un / sizeof(size_t); break; // DT_FINI_ARRAYSZ
+		case 0x1D: runpath = it; break; // DT_RUNPATH
+		case 0x1E: flags = it->d_un; break; // DT_FLAGS
+		case 0x23: relrsz = it->d_un; break; // DT_RELRSZ
+		case 0x24: image->relr = (const size_t*) dyn_ptr(base, it->d_un); break; // DT_RELR
+		case 0x25: relrent = it->d_un; break; // DT_RELRENT
+		case 0x6000000f: image->android_rel = (const uchar*) dyn_ptr(base, it->d_un); break; // DT_ANDROID_REL
+		case 0x60000010: image->android_rel_size = it->d_un; break; // DT_ANDROID_RELSZ
+		case 0x60000011: image->android_rela = (const uchar*) dyn_ptr(base, it->d_un); break; // DT_ANDROID_RELA
+		case 0x60000012: image->android_rela_size = it->d_un; break; // DT_ANDROID_RELASZ
+		case 0x6fffe000: android_relr = (const size_t*) dyn_ptr(base, it->d_un); break; // DT_ANDROID_RELR
+		case 0x6fffe001: android_relrsz = it->d_un; break; // DT_ANDROID_RELRSZ
+		case 0x6ffffef5: image->gnu_hash = (const uint*) dyn_ptr(base, it->d_un); break; // DT_GNU_HASH
+		case 0x6ffffff9: relacount = it->d_un; break; // DT_RELACOUNT
+		case 0x6ffffffa: relcount = it->d_un; break; // DT_RELCOUNT
+		case 0x6ffffffb: flags_1 = it->d_un; break; // DT_FLAGS_1
+		}
+	}
+
+	if (image->strtab == NULL) {
+		LOGE("string table not found.\n");
+		return 0;
+	}
+	if (image->symtab && syment != sizeof(elf_sym)) {
+		LOGE("unexpected symbol table entry size.\n");
+		return 0;
+	}
+	if (rela && relaent != sizeof(elf_rela)) {
+		LOGE("unexpected rela table entry size.\n");
+		return 0;
+	}
+	if (rel && relent != sizeof(elf_rel)) {
+		LOGE("unexpected rel table entry size.\n");
+		return 0;
+	}
+	if (image->relr && relrent != sizeof(size_t)) {
+		LOGE("unexpected relr table entry size.\n");
+		return 0;
+	}
+	if (image->jmprel && pltrel != 7 && pltrel != 0x11) { // DT_RELA, DT_REL
+		LOGE("unexpected plt rel type: %d.\n", (int) pltrel);
+		return 0;
+	}
+
+	if (rela) {
+		size_t count = relasz / sizeof(elf_rela);
+		if (relacount > count) relacount = count;
+		image->relative_rela = rela;
+		image->relative_rela_count = relacount;
+		image->rela = rela + relacount;
+		image->rela_count = count - relacount;
+	}
+	if (rel) {
+		size_t count = relsz / sizeof(elf_rel);
+		if (relcount > count) relcount = count;
+		image->relative_rel = rel;
+		image->relative_rel_count = relcount;
+		image->rel = rel + relcount;
+		image->rel_count = count - relcount;
+	}
+	if (image->relr) {
+		image->relr_count = relrsz / sizeof(size_t);
+	} else if (android_relr) {
+		image->relr = android_relr;
+		image->relr_count = android_relrsz / sizeof(size_t);
+	}
+	if (image->jmprel) {
+		image->jmprel_is_rela = pltrel == 7;
+		image->jmprel_count = pltrelsz / (image->jmprel_is_rela ? sizeof(elf_rela) : sizeof(elf_rel));
+	}
+	if ((flags & 8) || (flags_1 & 1)) image->bind_now = 1; // DF_BIND_NOW, DF_1_NOW
+	if (flags & 4) image->textrel = 1; // DF_TEXTREL
+	if (soname) image->soname = image->strtab + soname->d_un;
+	if (rpath) image->rpath = image->strtab + rpath->d_un;
+	if (runpath) image->runpath = image->strtab + runpath->d_un;
+	if (image->symtab) image->symbol_count = count_symbols(image->gnu_hash, image->sysv_hash);
+	return 1;
+}
+
+// defined DT_SYMTAB symbol, NULL if missing or undefined
+static const elf_sym* find_image_symbol(const loaded_image* image, const char* symbol) {
+	if (image == NULL || image->symtab == NULL) return NULL;
+	const elf_sym* symtab = (const elf_sym*) image->symtab;
+	const elf_sym* sym;
+	if (image->gnu_hash) {
+		sym = gnu_hash_lookup(image->gnu_hash, symtab, image->strtab, symbol);
+	} else if (image->sysv_hash) {
+		sym = sysv_hash_lookup(image->sysv_hash, symtab, image->strtab, symbol);
+	} else {
+		sym = linear_lookup(symtab, image->strtab, image->strsz, symbol);
+	}
+
+	if (sym == NULL) {
+		// LOGE("failed to resolve symbol `%s' from library (%p): not found.\n", symbol, image->base);
+		return NULL;
+	}
+	if (sym->st_value == 0) {
+		// LOGE("failed to resolve symbol `%s' from library (%p): value is NULL.\n", symbol, image->base);
+		return NULL;
+	}
+	return sym;
+}
+
+void* get_image_symbol(const loaded_image* image, const char* symbol) {
+	const elf_sym* sym = find_image_symbol(image, symbol);
+	if (sym == NULL) return NULL;
+	if (elf_st_type(sym->st_info) != 10) { // STT_GNU_IFUNC
+		return (void*) ((size_t) image->base + sym->st_value);
+	}
+	return (void*) resolve_ifunc(image, sym - (const elf_sym*) image->symtab);
+}
+
+// with lock_loader held
+static SymbolIndex* get_symbol_index(ImageList* image) {
+	if (image->symbol_index == NULL) {
+		image->symbol_index = build_symbol_index(&image->image, image->path);
+	}
+	return image->symbol_index;
+}
+
+// .symtab of the file an image was loaded from, for static images and symbols DT_SYMTAB doesn't have
+static void* get_file_symbol(const loaded_image* image, const char* symbol) {
+	ImageList* node = image_node(image);
+	if (node->path == NULL) return NULL; // not loaded from a file, or not with mmap
+	lock_loader();
+	SymbolIndex* index = get_symbol_index(node);
+	const elf_sym* sym = find_file_symbol(index, symbol);
+	if (sym == NULL || sym->st_value == 0) {
+		unlock_loader();
+		return NULL;
+	}
+	if (elf_st_type(sym->st_info) != 10) { // STT_GNU_IFUNC
+		unlock_loader();
+		return (void*) ((size_t) image->base + sym->st_value);
+	}
+	const void** slot = file_ifunc_target(index, sym); // freed with the index, after the image is unlinked
+	const void* target = slot ? *slot : NULL;
+	unlock_loader();
+	if (target) return (void*) target;
+	target = (const void*) call_ifunc_resolver((size_t) image->base + sym->st_value); // unlocked, it may bind lazily
+	if (slot == NULL) return (void*) target;
+	lock_loader();
+	if (*slot == NULL) *slot = target; // first one wins if called concurrently
+	target = *slot;
+	unlock_loader();
+	return (void*) target;
+}
+
+void* get_symbol_by_name(void* base, const char* symbol) {
+	const loaded_image* image = get_loaded_image(base);
+	if (image == NULL) return NULL;
+	void* addr = get_image_symbol(image, symbol);
+	return addr ? addr : get_file_symbol(image, symbol);
+}
+
+int lookup_address(const void* addr, const char** name, size_t* offset) {
+	lock_loader();
+	for (ImageList* image = image_header.next; image; image = image->next) {
+		if ((size_t) addr - (size_t) image->start >= image->span) continue;
+		int found = find_address_symbol(get_symbol_index(image), (size_t) addr, name, offset);
+		unlock_loader();
+		return found;
+	}
+	unlock_loader();
+	Dl_info info;
+	if (dladdr(addr, &info) && info.dli_sname) {
+		*name = info.dli_sname;
+		*offset = (size_t) addr - (size_t) info.dli_saddr;
+		return 1;
+	}
+	return 0;
 }
 
 void* get_symbol_by_offset(void* base, size_t offset) {
@@ -751,3 +2491,19 @@ void* load_elf(const char* elf_path) {
 	}
 	return base;
 }
+
+const loaded_image* load_elf_ex(const char* elf_path) {
+	return get_loaded_image(load_elf(elf_path));
+}
+
+void* load_elf_fd(int fd, off_t offset, size_t size) {
+	void* base = load_with_mmap_fd(fd, offset, size);
+	assert(base != BADADDR);
+	return base;
+}
+
+void* load_elf_mem(const void* buf, size_t len) {
+	void* base = load_with_mmap_mem(buf, len);
+	assert(base != BADADDR);
+	return base;
+}
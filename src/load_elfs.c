@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "logger.h"
+#include "elf_struct.h"
+#include "load_elf.h"
+#include "load_elf_internal.h"
+
+// load_elfs: images of the batch are mapped and relocated by a pool of threads,
+// each one after the images of the batch it needs (DT_NEEDED), so their symbols are visible.
+// init runs afterwards on the caller's thread, dependencies first.
+
+typedef struct LoadJob {
+	const char* path;
+	const char* name; // basename of path
+	char* soname; // DT_SONAME, NULL if none
+	char** needed; // DT_NEEDED
+	size_t needed_count;
+	size_t* dependents; // jobs needing this one
+	size_t dependent_count;
+	size_t pending; // jobs this one needs, not loaded yet
+	int queued;
+	void* base;
+} LoadJob;
+
+typedef struct LoadQueue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	LoadJob* jobs;
+	size_t count;
+	size_t* ready; // jobs with nothing pending
+	size_t ready_count;
+	size_t* done; // in load order, dependencies first
+	size_t done_count;
+	size_t running;
+} LoadQueue;
+
+static char* read_string(const char* strtab, size_t strsz, size_t offset) {
+	return offset < strsz ? strdup(strtab + offset) : NULL;
+}
+
+// DT_SONAME and DT_NEEDED read from the file, none if it can't be parsed (compressed, static...)
+static void scan_dynamic(LoadJob* job) {
+	int fd = open(job->path, O_RDONLY);
+	if (fd < 0) return;
+	elf_header header;
+	elf_program_header* phdrs = NULL;
+	elf_dyn* dyn = NULL;
+	char* strtab = NULL;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || *(uint*) header.e_ident != 0x464c457f
+		|| header.e_phentsize != sizeof(elf_program_header)) goto done;
+	phdrs = (elf_program_header*) malloc(header.e_phnum * sizeof(elf_program_header));
+	if (pread(fd, phdrs, header.e_phnum * sizeof(elf_program_header), header.e_phoff) != header.e_phnum * sizeof(elf_program_header)) goto done;
+	size_t dyn_count = 0;
+	for (int i = 0; i < header.e_phnum; i++) {
+		if (phdrs[i].p_type != 2) continue; // PT_DYNAMIC
+		dyn_count = phdrs[i].p_filesz / sizeof(elf_dyn);
+		dyn = (elf_dyn*) malloc(dyn_count * sizeof(elf_dyn) + 1);
+		if (pread(fd, dyn, dyn_count * sizeof(elf_dyn), phdrs[i].p_offset) != dyn_count * sizeof(elf_dyn)) goto done;
+		break;
+	}
+	size_t strtab_vaddr = 0, strsz = 0;
+	for (size_t i = 0; i < dyn_count && dyn[i].d_tag != 0; i++) {
+		if (dyn[i].d_tag == 5) strtab_vaddr = dyn[i].d_un; // DT_STRTAB
+		if (dyn[i].d_tag == 0xA) strsz = dyn[i].d_un; // DT_STRSZ
+	}
+	for (int i = 0; i < header.e_phnum && strsz; i++) {
+		if (phdrs[i].p_type != 1 || strtab_vaddr - phdrs[i].p_vaddr >= phdrs[i].p_filesz) continue; // PT_LOAD
+		strtab = (char*) malloc(strsz + 1);
+		if (pread(fd, strtab, strsz, strtab_vaddr - phdrs[i].p_vaddr + phdrs[i].p_offset) != strsz) goto done;
+		strtab[strsz] = 0;
+		break;
+	}
+	if (strtab == NULL) goto done;
+	for (size_t i = 0; i < dyn_count && dyn[i].d_tag != 0; i++) {
+		if (dyn[i].d_tag == 0xE) { // DT_SONAME
+			free(job->soname);
+			job->soname = read_string(strtab, strsz, dyn[i].d_un);
+		} else if (dyn[i].d_tag == 1) { // DT_NEEDED
+			char* needed = read_string(strtab, strsz, dyn[i].d_un);
+			if (needed == NULL) continue;
+			job->needed = (char**) realloc(job->needed, (job->needed_count + 1) * sizeof(char*));
+			job->needed[job->needed_count++] = needed;
+		}
+	}
+done:
+	free(strtab);
+	free(dyn);
+	free(phdrs);
+	close(fd);
+}
+
+static void add_dependency(LoadJob* jobs, size_t job, size_t dep) {
+	LoadJob* d = &jobs[dep];
+	for (size_t i = 0; i < d->dependent_count; i++) {
+		if (d->dependents[i] == job) return; // needed twice
+	}
+	d->dependents = (size_t*) realloc(d->dependents, (d->dependent_count + 1) * sizeof(size_t));
+	d->dependents[d->dependent_count++] = job;
+	jobs[job].pending++;
+}
+
+static void push_ready(LoadQueue* queue, size_t job) {
+	queue->jobs[job].queued = 1;
+	queue->ready[queue->ready_count++] = job;
+}
+
+static void* load_worker(void* arg) {
+	LoadQueue* queue = (LoadQueue*) arg;
+	pthread_mutex_lock(&queue->lock);
+	while (queue->done_count < queue->count) {
+		if (queue->ready_count == 0) {
+			if (queue->running) {
+				pthread_cond_wait(&queue->cond, &queue->lock);
+				continue;
+			}
+			// nothing running and nothing ready: the rest needs each other
+			for (size_t i = 0; i < queue->count; i++) {
+				if (!queue->jobs[i].queued) {
+					LOGW("circular DT_NEEDED in load_elfs, loading `%s' first.\n", queue->jobs[i].path);
+					push_ready(queue, i);
+					break;
+				}
+			}
+		}
+		LoadJob* job = &queue->jobs[queue->ready[--queue->ready_count]];
+		queue->running++;
+		pthread_mutex_unlock(&queue->lock);
+
+		set_defer_init(1);
+		void* base = load_with_mmap(job->path);
+		set_defer_init(0); // not consumed by static images
+		if (base != BADADDR) {
+			publish_library(job->name, base);
+		}
+
+		pthread_mutex_lock(&queue->lock);
+		queue->running--;
+		job->base = base;
+		queue->done[queue->done_count++] = job - queue->jobs;
+		for (size_t i = 0; i < job->dependent_count; i++) {
+			LoadJob* dependent = &queue->jobs[job->dependents[i]];
+			if (--dependent->pending == 0 && !dependent->queued) push_ready(queue, job->dependents[i]);
+		}
+		pthread_cond_broadcast(&queue->cond);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
+}
+
+int load_elfs(const char** paths, void** bases, size_t n, int threads) {
+	LOGI("loading %lu images with mmap...\n", n);
+	LoadQueue queue;
+	queue.jobs = (LoadJob*) calloc(n + 1, sizeof(LoadJob));
+	queue.count = n;
+	queue.ready = (size_t*) malloc((n + 1) * sizeof(size_t));
+	queue.ready_count = 0;
+	queue.done = (size_t*) malloc((n + 1) * sizeof(size_t));
+	queue.done_count = 0;
+	queue.running = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+
+	for (size_t i = 0; i < n; i++) {
+		LoadJob* job = &queue.jobs[i];
+		job->path = paths[i];
+		const char* slash = strrchr(paths[i], '/');
+		job->name = slash ? slash + 1 : paths[i];
+		scan_dynamic(job);
+	}
+	// DT_NEEDED matching DT_SONAME or the file name of another image in the batch
+	for (size_t i = 0; i < n; i++) {
+		for (size_t k = 0; k < queue.jobs[i].needed_count; k++) {
+			const char* needed = queue.jobs[i].needed[k];
+			for (size_t j = 0; j < n; j++) {
+				if (j == i) continue;
+				if (strcmp(needed, queue.jobs[j].name) == 0 || (queue.jobs[j].soname && strcmp(needed, queue.jobs[j].soname) == 0)) {
+					LOGD("`%s' needs `%s'.\n", queue.jobs[i].path, queue.jobs[j].path);
+					add_dependency(queue.jobs, i, j);
+					break;
+				}
+			}
+		}
+	}
+	// popped from the end, so the first paths go first
+	for (size_t i = n; i > 0; i--) {
+		if (queue.jobs[i - 1].pending == 0) push_ready(&queue, i - 1);
+	}
+
+	if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > n) threads = n;
+	pthread_t* workers = (pthread_t*) malloc((threads + 1) * sizeof(pthread_t));
+	int started = 0;
+	for (int i = 1; i < threads; i++) { // the caller is one of them
+		if (pthread_create(&workers[started], NULL, load_worker, &queue) == 0) started++;
+	}
+	load_worker(&queue);
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+
+	int loaded = 0;
+	for (size_t i = 0; i < queue.done_count; i++) {
+		LoadJob* job = &queue.jobs[queue.done[i]];
+		if (job->base == BADADDR) continue;
+		loaded++;
+		const loaded_image* image = find_loaded_image(job->base);
+		if (image && image->dyn) {
+			LOGI("running init of %s...\n", job->path);
+			run_init(image);
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		LoadJob* job = &queue.jobs[i];
+		bases[i] = job->base;
+		for (size_t k = 0; k < job->needed_count; k++) free(job->needed[k]);
+		free(job->needed);
+		free(job->soname);
+		free(job->dependents);
+	}
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
+	free(queue.jobs);
+	free(queue.ready);
+	free(queue.done);
+	LOGI("load_elfs done, %d/%lu loaded.\n", loaded, n);
+	return loaded;
+}
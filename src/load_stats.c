@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "load_elf.h"
+#include "load_elf_internal.h"
+
+// stats of the image being loaded by this thread, kept after the load for get_load_stats.
+// a DT_NEEDED library loaded with mmap gets its own, the outer image's are restored after it.
+static __thread load_stats stats;
+static __thread int load_depth = 0;
+// pages of the last image loaded at depth 1, pages_dirtied is counted from /proc/self/pagemap when get_load_stats reads it
+static __thread void* dirty_start = NULL;
+static __thread size_t dirty_size = 0;
+
+_Static_assert(LOAD_STATS_RELOC_CLASSES == RELOC_CLASS_COUNT, "load_stats.relocs is indexed by reloc_class");
+
+static const char* const reloc_class_names[LOAD_STATS_RELOC_CLASSES] = {
+	"unknown", "none", "absolute", "relative", "glob_dat", "jump_slot", "copy", "irelative", "pc_relative", "tls",
+};
+
+ullong stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ullong) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+load_stats* current_load_stats() {
+	return &stats;
+}
+
+void enter_load_stats(load_stats* outer) {
+	if (load_depth++) *outer = stats;
+	else dirty_size = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+void leave_load_stats(const load_stats* outer) {
+	if (--load_depth) stats = *outer;
+}
+
+void count_reloc(int cls, size_t count) {
+	stats.relocs[cls] += count;
+}
+
+void set_load_stats_pages(void* start, size_t size) {
+	stats.pages = size >> 12;
+	if (load_depth == 1) {
+		dirty_start = start;
+		dirty_size = size;
+	}
+}
+
+const load_stats* get_load_stats() {
+	if (dirty_size) {
+		stats.pages_dirtied = count_dirty_pages(dirty_start, dirty_size);
+		dirty_size = 0;
+	}
+	return &stats;
+}
+
+void print_load_stats(const load_stats* s) {
+	printf("{\"total_ns\": %llu, \"header_ns\": %llu, \"reserve_ns\": %llu, \"mmap_ns\": %llu, \"segment_ns\": [",
+		s->total_ns, s->header_ns, s->reserve_ns, s->mmap_ns);
+	size_t segments = s->segment_count < LOAD_STATS_MAX_SEGMENTS ? s->segment_count : LOAD_STATS_MAX_SEGMENTS;
+	for (size_t i = 0; i < segments; i++) {
+		printf(i ? ", %llu" : "%llu", s->segment_ns[i]);
+	}
+	printf("], \"segment_count\": %lu, \"needed_ns\": %llu, \"reloc_ns\": %llu, \"init_ns\": %llu, \"fini_scan_ns\": %llu, \"relocs\": {",
+		(unsigned long) s->segment_count, s->needed_ns, s->reloc_ns, s->init_ns, s->fini_scan_ns);
+	for (int i = 0; i < LOAD_STATS_RELOC_CLASSES; i++) {
+		printf("%s\"%s\": %lu", i ? ", " : "", reloc_class_names[i], (unsigned long) s->relocs[i]);
+	}
+	printf("}, \"symbols\": {\"cache_hits\": %lu, \"registered\": %lu, \"dlsym\": %lu, \"library\": %lu, \"unresolved\": %lu}, \"pages\": %lu, \"pages_dirtied\": %lu}\n",
+		(unsigned long) s->symbol_cache_hits, (unsigned long) s->symbols_registered, (unsigned long) s->symbols_dlsym, (unsigned long) s->symbols_library,
+		(unsigned long) s->symbols_unresolved, (unsigned long) s->pages, (unsigned long) s->pages_dirtied);
+}
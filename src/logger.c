@@ -28,6 +28,7 @@ void Log(int log_level, const char* format, ...) {
 	if (log_level < 0) log_level = 0;
 	if (log_level > 4) log_level = 4;
 	if (log_level > _log_level) return;
+	flockfile(stdout); // one line at a time from load_elfs threads
 	if (_log_color) printf("%s", LOG_LEVEL_COLORS[log_level]);
 	printf("[%c] ", LOG_LEVEL_CHARS[log_level]);
 	va_list args;
@@ -36,4 +37,5 @@ void Log(int log_level, const char* format, ...) {
 	va_end(args);
 	if (_log_color) printf("\x1b[0m");
 	fflush(stdout);
+	funlockfile(stdout);
 }
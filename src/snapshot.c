@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "logger.h"
+#include "elf_struct.h"
+#include "load_elf.h"
+#include "reloc.h"
+#include "load_elf_internal.h"
+
+// snapshot file layout:
+//   snapshot_header
+//   snapshot_segment[segment_count]
+//   snapshot_external[external_count]
+//   segment data, each at page aligned file_offset
+
+#define SNAPSHOT_MAGIC "LESNAP02"
+
+typedef struct {
+	char magic[8];
+	size_t base;
+	size_t span; // base .. base + span is reserved when restoring
+	size_t segment_count;
+	size_t external_count;
+} snapshot_header;
+
+typedef struct {
+	size_t vaddr; // page aligned, relative to base
+	size_t size; // page aligned
+	size_t file_offset;
+	size_t prot; // PROT_* of the PT_LOADs sharing these pages
+} snapshot_segment;
+
+// relocation against a symbol from outside the image, patched when restoring
+typedef struct {
+	size_t offset;
+	size_t info;
+	size_t addend;
+	size_t addr; // symbol address when saved
+} snapshot_external;
+
+typedef struct {
+	snapshot_external* items;
+	size_t count;
+	size_t capacity;
+} ExternalList;
+
+static int is_external(size_t info, const elf_sym* symtab) {
+	const reloc_desc* desc = find_reloc_desc(info);
+	switch (desc->cls) {
+	case RELOC_ABSOLUTE:
+	case RELOC_GLOB_DAT:
+	case RELOC_JUMP_SLOT:
+	case RELOC_PC_RELATIVE:
+	case RELOC_COPY:
+		return symtab && elf_r_sym(info) && symtab[elf_r_sym(info)].st_value == 0;
+	default:
+		return 0;
+	}
+}
+
+// arg: ExternalList
+static int collect_external(void* arg, void* base, size_t offset, size_t info, size_t addend, const elf_sym* symtab, const char* strtab) {
+	ExternalList* externals = (ExternalList*) arg;
+	if (!is_external(info, symtab)) return 1;
+	if (externals->count == externals->capacity) {
+		size_t capacity = externals->capacity ? externals->capacity * 2 : 64;
+		snapshot_external* items = (snapshot_external*) realloc(externals->items, capacity * sizeof(snapshot_external));
+		if (items == NULL) {
+			LOGE("out of memory.\n");
+			return 0;
+		}
+		externals->items = items;
+		externals->capacity = capacity;
+	}
+	snapshot_external* e = &externals->items[externals->count++];
+	e->offset = offset;
+	e->info = info;
+	e->addend = addend;
+	e->addr = (size_t) get_global_symbol(strtab + symtab[elf_r_sym(info)].st_name);
+	return 1;
+}
+
+static int write_all(int fd, const void* buf, size_t size) {
+	while (size) {
+		ssize_t n = write(fd, buf, size);
+		if (n <= 0) return 0;
+		buf = (const void*) ((size_t) buf + n);
+		size -= n;
+	}
+	return 1;
+}
+
+static int read_all(int fd, void* buf, size_t size) {
+	while (size) {
+		ssize_t n = read(fd, buf, size);
+		if (n <= 0) return 0;
+		buf = (void*) ((size_t) buf + n);
+		size -= n;
+	}
+	return 1;
+}
+
+// page aligned PT_LOAD ranges of the loaded image, overlapping pages merged
+static size_t get_segments(void* base, snapshot_segment* segments) {
+	elf_header* header = (elf_header*) base;
+	elf_program_header* pheader = (elf_program_header*) ((size_t) base + header->e_phoff);
+	size_t count = 0;
+	for (int i = 0; i < header->e_phnum; i++, pheader++) {
+		if (pheader->p_type != 1 || pheader->p_memsz == 0) continue; // not PT_LOAD or nothing to load
+		size_t start = pheader->p_vaddr & ~0xfff;
+		size_t end = (pheader->p_vaddr + pheader->p_memsz + 0xfff) & ~0xfff;
+		if (count && start <= segments[count - 1].vaddr + segments[count - 1].size) {
+			if (end > segments[count - 1].vaddr + segments[count - 1].size) {
+				segments[count - 1].size = end - segments[count - 1].vaddr;
+			}
+			segments[count - 1].prot |= segment_prot(pheader->p_flags);
+			continue;
+		}
+		segments[count].vaddr = start;
+		segments[count].size = end - start;
+		segments[count].prot = segment_prot(pheader->p_flags);
+		count++;
+	}
+	return count;
+}
+
+int save_image_snapshot(void* base, const char* path) {
+	if (base == NULL || base == BADADDR) {
+		LOGE("snapshot of non-pie image is not supported.\n");
+		return 0;
+	}
+	const loaded_image* image = get_loaded_image(base);
+	if (image == NULL || image->dyn == NULL) {
+		LOGE("snapshot of image without DYNAMIC is not supported.\n");
+		return 0;
+	}
+	const size_t* got = image->pltgot;
+	if (got && got[2] == (size_t) lazy_bind_trampoline) {
+		LOGE("snapshot of lazily bound image is not supported.\n");
+		return 0;
+	}
+
+	elf_header* header = (elf_header*) base;
+	snapshot_segment* segments = (snapshot_segment*) malloc(header->e_phnum * sizeof(snapshot_segment));
+	snapshot_header snap;
+	memcpy(snap.magic, SNAPSHOT_MAGIC, 8);
+	snap.base = (size_t) base;
+	snap.segment_count = get_segments(base, segments);
+	snap.span = snap.segment_count ? segments[snap.segment_count - 1].vaddr + segments[snap.segment_count - 1].size : 0;
+
+	ExternalList externals = { NULL, 0, 0 };
+	if (!for_each_reloc(image, collect_external, &externals)) {
+		free(externals.items);
+		free(segments);
+		return 0;
+	}
+	snap.external_count = externals.count;
+
+	size_t file_offset = sizeof(snap) + snap.segment_count * sizeof(snapshot_segment) + snap.external_count * sizeof(snapshot_external);
+	for (size_t i = 0; i < snap.segment_count; i++) {
+		file_offset = (file_offset + 0xfff) & ~0xfff;
+		segments[i].file_offset = file_offset;
+		file_offset += segments[i].size;
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LOGE("failed to create snapshot `%s'.\n", path);
+		free(externals.items);
+		free(segments);
+		return 0;
+	}
+	int ok = write_all(fd, &snap, sizeof(snap))
+		&& write_all(fd, segments, snap.segment_count * sizeof(snapshot_segment))
+		&& write_all(fd, externals.items, snap.external_count * sizeof(snapshot_external));
+	for (size_t i = 0; ok && i < snap.segment_count; i++) {
+		ok = lseek(fd, segments[i].file_offset, SEEK_SET) == (off_t) segments[i].file_offset
+			&& write_all(fd, (const void*) ((size_t) base + segments[i].vaddr), segments[i].size);
+	}
+	close(fd);
+	free(externals.items);
+	free(segments);
+	if (!ok) {
+		LOGE("failed to write snapshot `%s'.\n", path);
+		unlink(path);
+		return 0;
+	}
+	LOGI("snapshot of %p saved to %s, %lu external relocations.\n", base, path, snap.external_count);
+	return 1;
+}
+
+// symbols may have moved since the snapshot was saved (aslr, other registered symbols)
+static int apply_external(void* base, const snapshot_external* e, const elf_sym* symtab, const char* strtab) {
+	const elf_sym* s = &symtab[elf_r_sym(e->info)];
+	size_t addr = (size_t) get_global_symbol(strtab + s->st_name);
+	if (addr == e->addr) return 1;
+	const reloc_desc* desc = find_reloc_desc(e->info);
+	void* slot = (void*) ((size_t) base + e->offset);
+	LOGV("%s at +0x%lx: `%s' moved from 0x%lx to 0x%lx.\n", desc->name, e->offset, strtab + s->st_name, e->addr, addr);
+	if (addr == 0) {
+		LOGW("failed to resolve symbol `%s'.\n", strtab + s->st_name);
+		return 1;
+	}
+	if (desc->cls == RELOC_COPY) {
+		memcpy(slot, (const void*) addr, s->st_size);
+	} else if (e->addr == 0) { // not applied when saved
+		return do_reloc(base, e->offset, e->info, e->addend, symtab, strtab);
+	} else if (desc->width == 4) {
+		*(uint*) slot += (uint) (addr - e->addr);
+	} else {
+		*(size_t*) slot += addr - e->addr;
+	}
+	return 1;
+}
+
+// segments are mapped with their own prot, pages of read-only ones are writable while patched
+static int patch_external(void* base, const snapshot_external* e, const elf_sym* symtab, const char* strtab, const snapshot_segment* segments, size_t segment_count) {
+	const snapshot_segment* segment = NULL;
+	for (size_t i = 0; i < segment_count; i++) {
+		if (e->offset - segments[i].vaddr < segments[i].size) segment = &segments[i];
+	}
+	if (segment == NULL) {
+		LOGE("external relocation at +0x%lx out of image.\n", e->offset);
+		return 0;
+	}
+	if (segment->prot & PROT_WRITE) return apply_external(base, e, symtab, strtab);
+	void* page = (void*) (((size_t) base + e->offset) & ~0xfff);
+	size_t size = (((size_t) base + e->offset + sizeof(size_t) + 0xfff) & ~0xfff) - (size_t) page;
+	mprotect(page, size, segment->prot | PROT_WRITE);
+	int ok = apply_external(base, e, symtab, strtab);
+	mprotect(page, size, segment->prot);
+	return ok;
+}
+
+void* load_image_snapshot(const char* path) {
+	LOGI("loading snapshot %s...\n", path);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LOGE("file `%s' not found.\n", path);
+		return NULL;
+	}
+	snapshot_header snap;
+	if (!read_all(fd, &snap, sizeof(snap)) || memcmp(snap.magic, SNAPSHOT_MAGIC, 8) != 0) {
+		LOGE("invalid snapshot `%s'.\n", path);
+		close(fd);
+		return NULL;
+	}
+	snapshot_segment* segments = (snapshot_segment*) malloc(snap.segment_count * sizeof(snapshot_segment) + 1);
+	snapshot_external* items = (snapshot_external*) malloc(snap.external_count * sizeof(snapshot_external) + 1);
+	void* base = (void*) snap.base;
+	void* reserved = MAP_FAILED;
+	if (!read_all(fd, segments, snap.segment_count * sizeof(snapshot_segment))
+		|| !read_all(fd, items, snap.external_count * sizeof(snapshot_external))) {
+		LOGE("invalid snapshot `%s'.\n", path);
+		goto fail;
+	}
+
+	reserved = mmap(base, snap.span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (reserved != base) {
+		LOGE("failed to reserve %p, size 0x%lx.\n", base, snap.span);
+		goto fail;
+	}
+	for (size_t i = 0; i < snap.segment_count; i++) {
+		void* addr = (void*) ((size_t) base + segments[i].vaddr);
+		if (addr != mmap(addr, segments[i].size, segments[i].prot, MAP_PRIVATE | MAP_FIXED, fd, segments[i].file_offset)) {
+			LOGE("failed to mmap 0x%lx to %p.\n", segments[i].file_offset, addr);
+			goto fail;
+		}
+		LOGD("mmaped 0x%lx to %p, size 0x%lx\n", segments[i].file_offset, addr, segments[i].size);
+	}
+	close(fd);
+	fd = -1;
+
+	elf_header* header = (elf_header*) base;
+	loaded_image parsed;
+	if (!parse_image(&parsed, base, get_dyn(base), (const elf_program_header*) ((size_t) base + header->e_phoff), header->e_phnum)) goto fail;
+	const loaded_image* image = register_image(base, snap.span, &parsed, NULL); // before DT_NEEDED are loaded, they are recorded in it
+	load_needed_libraries(image, NULL);
+	for (size_t i = 0; i < snap.external_count; i++) {
+		if (!patch_external(base, &items[i], (const elf_sym*) image->symtab, image->strtab, segments, snap.segment_count)) goto fail;
+	}
+	protect_relro(image);
+	free(segments);
+	free(items);
+
+	run_init(image);
+	LOGI("done, snapshot restored at %p\n", base);
+	return base;
+
+fail:
+	if (reserved == base) {
+		discard_image(base);
+		munmap(base, snap.span);
+	}
+	else if (reserved != MAP_FAILED) munmap(reserved, snap.span); // MAP_FIXED_NOREPLACE unknown to kernel
+	if (fd >= 0) close(fd);
+	free(segments);
+	free(items);
+	return NULL;
+}
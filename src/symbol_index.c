@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "logger.h"
+#include "elf_struct.h"
+#include "load_elf.h"
+#include "load_elf_internal.h"
+#include "symbol_table.h"
+
+// symbols of an image loaded with mmap: DT_SYMTAB, and the .symtab of the file it was loaded from
+// (not part of any PT_LOAD, mapped read-only for the life of the image)
+// the address index and the name index are built on first use
+
+typedef struct AddressSymbol {
+	size_t start;
+	size_t size;
+	size_t max_end; // of this one and the ones before, enclosing symbols are found behind nested ones
+	const char* name;
+	int rank; // same start: global, weak, then local
+} AddressSymbol;
+
+struct SymbolIndex {
+	const loaded_image* image;
+	const elf_sym* file_symtab; // .symtab, NULL if the file has none
+	size_t file_symbol_count;
+	const char* file_strtab;
+	size_t file_strsz;
+	void* map; // covers .symtab and .strtab
+	size_t map_size;
+	AddressSymbol* by_address;
+	size_t address_count;
+	int address_built;
+	SymbolTable by_name; // .symtab name -> elf_sym
+	int name_built;
+	const void** ifunc_targets; // .symtab STT_GNU_IFUNC targets by symbol index, allocated on first use
+};
+
+// .symtab and the string table it links to, 0 if the file has none
+static int map_file_symtab(SymbolIndex* index, const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	int ok = 0;
+	elf_section_header* sheaders = NULL;
+	elf_header header;
+	struct stat st;
+	if (fstat(fd, &st) || pread(fd, &header, sizeof(header), 0) != sizeof(header)) goto done;
+	if (*(uint*) header.e_ident != 0x464c457f || header.e_shentsize != sizeof(elf_section_header) || header.e_shnum == 0) goto done; // compressed or no section headers
+	size_t size = header.e_shnum * sizeof(elf_section_header);
+	sheaders = (elf_section_header*) malloc(size);
+	if (pread(fd, sheaders, size, header.e_shoff) != size) goto done;
+	for (int i = 0; i < header.e_shnum; i++) {
+		const elf_section_header* symtab = &sheaders[i];
+		if (symtab->s_type != 2 || symtab->s_entsize != sizeof(elf_sym) || symtab->s_link >= header.e_shnum) continue; // SHT_SYMTAB
+		const elf_section_header* strtab = &sheaders[symtab->s_link];
+		if (symtab->s_offset + symtab->s_size > st.st_size || strtab->s_offset + strtab->s_size > st.st_size) break;
+		size_t start = (symtab->s_offset < strtab->s_offset ? symtab->s_offset : strtab->s_offset) & ~0xfff;
+		size_t end = symtab->s_offset + symtab->s_size > strtab->s_offset + strtab->s_size ? symtab->s_offset + symtab->s_size : strtab->s_offset + strtab->s_size;
+		void* map = mmap(NULL, end - start, PROT_READ, MAP_PRIVATE, fd, start);
+		if (map == MAP_FAILED) break;
+		index->map = map;
+		index->map_size = end - start;
+		index->file_symtab = (const elf_sym*) ((size_t) map + symtab->s_offset - start);
+		index->file_symbol_count = symtab->s_size / sizeof(elf_sym);
+		index->file_strtab = (const char*) ((size_t) map + strtab->s_offset - start);
+		index->file_strsz = strtab->s_size;
+		LOGD("%lu .symtab symbols mapped from `%s'.\n", index->file_symbol_count, path);
+		ok = 1;
+		break;
+	}
+done:
+	free(sheaders);
+	close(fd);
+	return ok;
+}
+
+// functions and objects of the image, undefined, absolute and tls symbols are skipped
+static void add_address_symbols(SymbolIndex* index, size_t* capacity, void* base, const elf_sym* symtab, size_t count, const char* strtab, size_t strsz) {
+	for (size_t i = 1; i < count; i++) {
+		const elf_sym* sym = &symtab[i];
+		uint type = elf_st_type(sym->st_info);
+		if (sym->st_value == 0 || sym->shndx == 0 || sym->shndx == 0xfff1) continue; // SHN_UNDEF, SHN_ABS
+		if (type != 0 && type != 1 && type != 2 && type != 10) continue; // STT_NOTYPE, STT_OBJECT, STT_FUNC, STT_GNU_IFUNC
+		if (sym->st_name == 0 || sym->st_name >= strsz) continue;
+		if (index->address_count == *capacity) {
+			*capacity = *capacity ? *capacity * 2 : 256;
+			index->by_address = (AddressSymbol*) realloc(index->by_address, *capacity * sizeof(AddressSymbol));
+		}
+		AddressSymbol* s = &index->by_address[index->address_count++];
+		s->start = (size_t) base + sym->st_value;
+		s->size = sym->st_size;
+		s->name = strtab + sym->st_name;
+		uint bind = elf_st_bind(sym->st_info);
+		s->rank = bind == 1 ? 0 : bind == 2 ? 1 : 2; // STB_GLOBAL, STB_WEAK
+	}
+}
+
+static int compare_address_symbol(const void* a, const void* b) {
+	const AddressSymbol* x = (const AddressSymbol*) a;
+	const AddressSymbol* y = (const AddressSymbol*) b;
+	if (x->start != y->start) return x->start < y->start ? -1 : 1;
+	if (x->size != y->size) return x->size > y->size ? -1 : 1;
+	return x->rank - y->rank;
+}
+
+SymbolIndex* build_symbol_index(const loaded_image* image, const char* path) {
+	SymbolIndex* index = (SymbolIndex*) calloc(1, sizeof(SymbolIndex));
+	index->image = image;
+	if (path) map_file_symtab(index, path);
+	return index;
+}
+
+static void build_address_index(SymbolIndex* index) {
+	const loaded_image* image = index->image;
+	size_t capacity = 0;
+	if (image->symtab) {
+		add_address_symbols(index, &capacity, image->base, (const elf_sym*) image->symtab, image->symbol_count, image->strtab, image->strsz);
+	}
+	if (index->file_symtab) {
+		add_address_symbols(index, &capacity, image->base, index->file_symtab, index->file_symbol_count, index->file_strtab, index->file_strsz);
+	}
+	qsort(index->by_address, index->address_count, sizeof(AddressSymbol), compare_address_symbol);
+	size_t count = 0;
+	size_t max_end = 0;
+	for (size_t i = 0; i < index->address_count; i++) {
+		AddressSymbol* s = &index->by_address[i];
+		if (count && index->by_address[count - 1].start == s->start) continue; // aliases, .symtab repeating DT_SYMTAB
+		if (s->start + s->size > max_end) max_end = s->start + s->size;
+		s->max_end = max_end;
+		index->by_address[count++] = *s;
+	}
+	index->address_count = count;
+	index->address_built = 1;
+	LOGD("address index of %p: %lu symbols.\n", image->base, count);
+}
+
+// defined .symtab symbols by name, a global one wins over a weak or local one of the same name
+static void build_name_index(SymbolIndex* index) {
+	const elf_sym* symtab = index->file_symtab;
+	symbol_table_reserve(&index->by_name, index->file_symbol_count);
+	for (size_t i = 1; i < index->file_symbol_count; i++) {
+		const elf_sym* sym = &symtab[i];
+		uint type = elf_st_type(sym->st_info);
+		if (sym->shndx == 0 || sym->st_name == 0 || sym->st_name >= index->file_strsz) continue; // SHN_UNDEF
+		if (type == 3 || type == 4) continue; // STT_SECTION, STT_FILE
+		int inserted;
+		SymbolEntry* e = symbol_table_insert(&index->by_name, index->file_strtab + sym->st_name, &inserted);
+		if (!inserted && elf_st_bind(((const elf_sym*) e->addr)->st_info) == 1) continue; // STB_GLOBAL
+		if (!inserted && elf_st_bind(sym->st_info) != 1) continue;
+		e->addr = (void*) sym;
+	}
+	index->name_built = 1;
+	LOGD("name index of %p: %lu .symtab symbols.\n", index->image->base, index->by_name.count);
+}
+
+void free_symbol_index(SymbolIndex* index) {
+	if (index == NULL) return;
+	if (index->map) munmap(index->map, index->map_size);
+	free(index->by_address);
+	symbol_table_clear(&index->by_name);
+	free(index->ifunc_targets);
+	free(index);
+}
+
+// the innermost symbol containing addr (or starting at it, if its size is 0)
+int find_address_symbol(SymbolIndex* index, size_t addr, const char** name, size_t* offset) {
+	if (!index->address_built) build_address_index(index);
+	const AddressSymbol* symbols = index->by_address;
+	size_t lo = 0, hi = index->address_count; // first start > addr
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (symbols[mid].start <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	for (size_t i = lo; i > 0 && (symbols[i - 1].max_end > addr || symbols[i - 1].start == addr); i--) {
+		const AddressSymbol* s = &symbols[i - 1];
+		if (addr - s->start < s->size || addr == s->start) {
+			*name = s->name;
+			*offset = addr - s->start;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+const elf_sym* find_file_symbol(SymbolIndex* index, const char* symbol) {
+	if (index->file_symtab == NULL) return NULL;
+	if (!index->name_built) build_name_index(index);
+	SymbolEntry* e = symbol_table_find(&index->by_name, symbol);
+	return e ? (const elf_sym*) e->addr : NULL;
+}
+
+// cache slot of a .symtab symbol returned by find_file_symbol, NULL if out of memory
+const void** file_ifunc_target(SymbolIndex* index, const elf_sym* sym) {
+	if (index->ifunc_targets == NULL) {
+		index->ifunc_targets = (const void**) calloc(index->file_symbol_count, sizeof(void*));
+		if (index->ifunc_targets == NULL) return NULL;
+	}
+	return &index->ifunc_targets[sym - index->file_symtab];
+}
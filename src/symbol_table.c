@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+#include "symbol_table.h"
+
+#define MIN_CAPACITY 64
+
+unsigned int symbol_hash(const char* symbol) {
+	unsigned int h = 5381;
+	for (; *symbol; symbol++) {
+		h = (h << 5) + h + (unsigned char) *symbol;
+	}
+	return h;
+}
+
+static SymbolEntry* find_slot(SymbolEntry* entries, size_t capacity, const char* symbol, unsigned int hash) {
+	size_t mask = capacity - 1;
+	for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+		SymbolEntry* e = &entries[i];
+		if (e->symbol == NULL) return e;
+		if (e->hash == hash && strcmp(e->symbol, symbol) == 0) return e;
+	}
+}
+
+static void rehash(SymbolTable* table, size_t capacity) {
+	SymbolEntry* entries = (SymbolEntry*) calloc(capacity, sizeof(SymbolEntry));
+	for (size_t i = 0; i < table->capacity; i++) {
+		SymbolEntry* e = &table->entries[i];
+		if (e->symbol == NULL) continue;
+		*find_slot(entries, capacity, e->symbol, e->hash) = *e;
+	}
+	free(table->entries);
+	table->entries = entries;
+	table->capacity = capacity;
+}
+
+void symbol_table_reserve(SymbolTable* table, size_t count) {
+	size_t capacity = table->capacity ? table->capacity : MIN_CAPACITY;
+	while (capacity / 4 * 3 < count) { // load factor <= 0.75
+		capacity *= 2;
+	}
+	if (capacity != table->capacity) {
+		rehash(table, capacity);
+	}
+}
+
+SymbolEntry* symbol_table_find(const SymbolTable* table, const char* symbol) {
+	if (table->count == 0) return NULL;
+	SymbolEntry* e = find_slot(table->entries, table->capacity, symbol, symbol_hash(symbol));
+	return e->symbol ? e : NULL;
+}
+
+SymbolEntry* symbol_table_insert(SymbolTable* table, const char* symbol, int* inserted) {
+	symbol_table_reserve(table, table->count + 1);
+	unsigned int hash = symbol_hash(symbol);
+	SymbolEntry* e = find_slot(table->entries, table->capacity, symbol, hash);
+	if (e->symbol) {
+		if (inserted) *inserted = 0;
+		return e;
+	}
+	e->symbol = symbol;
+	e->addr = NULL;
+	e->hash = hash;
+	table->count++;
+	if (inserted) *inserted = 1;
+	return e;
+}
+
+void symbol_table_clear(SymbolTable* table) {
+	free(table->entries);
+	table->entries = NULL;
+	table->capacity = 0;
+	table->count = 0;
+}